@@ -0,0 +1,1203 @@
+#include "BVH.h"
+#include "Scene.h"
+#include "Shape.h"
+#include "helpers.h"
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <thread>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+const float INF = numeric_limits<float>::max();
+
+#define nullIntersect {INF,{},-1}
+#define noHit {INF,-1,-1,false,-1}
+
+// Relative costs of traversing a node and intersecting a primitive, used by the SAH
+const float traversalCost = 1.0f;
+const float intersectionCost = 1.0f;
+// Leaves never hold more primitives than this, no matter what the SAH says
+const int maxLeafSize = 8;
+// Median splits bring any range down to leaves within this many levels, they are all the builders make this close
+// to maxDepth
+const int medianLevels = 32;
+// 1 + 2 * gamma(3) from conservative ray-box intersection, compensates the rounding of the slab test
+const float robustScale = 1.0f + 2.0f * 3.0f * numeric_limits<float>::epsilon();
+
+// Number of bins per axis of the binned builder
+const int binCount = 16;
+// Ranges at least this big are binned and partitioned by all threads together
+const int parallelRangeSize = 1 << 15;
+// Subtrees at least this big are handed to a new thread while there are idle cores
+const int parallelTaskSize = 1 << 12;
+// Levels of the wide tree with at least this many nodes are refitted by all threads together
+const int parallelRefitSize = 256;
+
+/* Splits [begin, end) into numThreads contiguous chunks and runs body(chunk, chunkBegin, chunkEnd)
+on each of them, the last chunk on the calling thread. */
+template <typename Body>
+static void parallelFor(int begin, int end, int numThreads, const Body & body)
+{
+    int count = end - begin;
+    if (numThreads <= 1 || count < numThreads) {
+        body(0, begin, end);
+        return;
+    }
+
+    vector<thread> threads;
+    for (int chunk = 0; chunk < numThreads; ++chunk) {
+        int chunkBegin = begin + (long long) count * chunk / numThreads;
+        int chunkEnd = begin + (long long) count * (chunk + 1) / numThreads;
+        if (chunk == numThreads - 1)
+            body(chunk, chunkBegin, chunkEnd);
+        else
+            threads.emplace_back(body, chunk, chunkBegin, chunkEnd);
+    }
+    for (thread & t : threads)
+        t.join();
+}
+
+static inline float axisValue(const Vector3f & v, int axis)
+{
+    return (&v.x)[axis];
+}
+
+BVH::BVH()
+    : binaryNodeMemory(0), builtCost(0.0f), currentCost(0.0f)
+{
+}
+
+BVH::BVH(const Scene & scene, BuildMethod method)
+    : binaryNodeMemory(0), builtCost(0.0f), currentCost(0.0f)
+{
+    // Flatten meshes into their faces so that the tree sees every triangle separately, and build the tree of every
+    // instanced mesh once. Prototype meshes are only reached through their instances.
+    vector<const Shape *> shapes;
+    for (const Shape * object : scene.objects) {
+        const Mesh * mesh = dynamic_cast<const Mesh *>(object);
+        const Instance * instance = dynamic_cast<const Instance *>(object);
+        if (mesh) {
+            if (!mesh->prototype) {
+                for (const Triangle & face : mesh->getFaces())
+                    shapes.push_back(&face);
+            }
+        }
+        else if (!instance)
+            shapes.push_back(object);
+        else if (!instance->getMesh()->getFaces().empty()) {
+            if (!getMeshBVH(instance->getMesh()))
+                addMeshBVH(instance->getMesh(), new BVH(scene, *instance->getMesh(), method));
+            shapes.push_back(object);
+        }
+    }
+    build(scene, shapes, method);
+}
+
+BVH::BVH(const Scene & scene, const Mesh & mesh, BuildMethod method)
+    : binaryNodeMemory(0), builtCost(0.0f), currentCost(0.0f)
+{
+    vector<const Shape *> shapes;
+    for (const Triangle & face : mesh.getFaces())
+        shapes.push_back(&face);
+    build(scene, shapes, method);
+}
+
+// Builds the tree over shapes, which are spheres, triangles or instances of meshes whose tree is built already
+void BVH::build(const Scene & scene, const vector<const Shape *> & shapes, BuildMethod method)
+{
+    BuildState state;
+    state.method = method;
+    state.maxThreads = 1;
+    if (method == BinnedSAH)
+        state.maxThreads = max(1u, thread::hardware_concurrency());
+
+    int primCount = shapes.size();
+    if (primCount == 0)
+        return;
+    state.prims.resize(primCount);
+
+    // Instances are bounded by the box of their mesh's tree, not by going through the mesh
+    bool hasInstances = !meshBVHs.empty();
+    parallelFor(0, primCount, state.maxThreads, [&](int, int chunkBegin, int chunkEnd) {
+        for (int i = chunkBegin; i < chunkEnd; ++i) {
+            BuildPrimitive & prim = state.prims[i];
+            prim.primitive = {shapes[i], i};
+            const Instance * instance = hasInstances ? dynamic_cast<const Instance *>(shapes[i]) : nullptr;
+            if (instance)
+                prim.bounds = instance->getTransform().transformBounds(getMeshBVH(instance->getMesh())->bounds);
+            else
+                prim.bounds = shapes[i]->getBounds(scene);
+            prim.centroid = prim.bounds.center();
+        }
+    });
+
+    // A binary tree over n primitives never has more than 2n - 1 nodes
+    state.nodes.resize(2 * primCount - 1);
+    state.nodeCount = 1;
+    state.activeThreads = 1;
+
+    if (method == BinnedSAH) {
+        state.scratch.resize(primCount);
+        buildBinned(state, 0, 0, primCount, 0);
+    }
+    else {
+        buildSweep(state, 0, 0, primCount, 0);
+    }
+
+    state.nodes.resize(state.nodeCount);
+    binaryNodeMemory = state.nodes.size() * sizeof(Node);
+    vector<Primitive> binaryPrimitives(primCount);
+    for (int i = 0; i < primCount; ++i)
+        binaryPrimitives[i] = state.prims[i].primitive;
+
+    wideNodes.reserve(state.nodes.size() / 2 + 1);
+    wideNodes.resize(1);
+    collapse(state.nodes, binaryPrimitives, 0, 0);
+
+    triangles.resize(trianglePrimitives.size(), scene.intTestEps);
+    spheres.resize(spherePrimitives.size(), scene.intTestEps);
+    updateRecords(scene);
+    setInstanceRecords();
+
+    builtCost = currentCost = refitNodes(scene);
+}
+
+// Takes ownership of the tree over the faces of an instanced mesh
+void BVH::addMeshBVH(const Mesh * mesh, BVH * meshBVH)
+{
+    meshBVHs.push_back(unique_ptr<BVH>(meshBVH));
+    instancedMeshes.push_back(mesh);
+    meshBVHsByMesh[mesh] = meshBVH;
+}
+
+// Tree over the faces of an instanced mesh, nullptr if the mesh has none
+const BVH * BVH::getMeshBVH(const Mesh * mesh) const
+{
+    auto found = meshBVHsByMesh.find(mesh);
+    return found != meshBVHsByMesh.end() ? found->second : nullptr;
+}
+
+// Transforms and trees of the instances, which never change once built
+void BVH::setInstanceRecords()
+{
+    instances.resize(instancePrimitives.size());
+    for (int i = 0; i < (int) instancePrimitives.size(); ++i) {
+        const Instance * instance = static_cast<const Instance *>(instancePrimitives[i].shape);
+        instances[i] = {instance->getInverse(), instance->getTransform(), getMeshBVH(instance->getMesh()),
+                        instance->matIndex};
+    }
+}
+
+/* Fills the wide node standing for the binary subtree rooted at nodeIndex.
+The children of the binary node are taken as the initial children of the wide node, then the child
+with the largest surface area is repeatedly replaced with its own two children until the node is full.
+Wide node children are allocated together and so are the leaves of leaf children, whose primitives are appended
+to the array of their type in child order. Only spheres, triangles and instances are left after flattening the meshes. */
+void BVH::collapse(const vector<Node> & nodes, const vector<Primitive> & binaryPrimitives, int nodeIndex, int wideIndex)
+{
+    int candidates[BVH_WIDTH];
+    int candidateCount = 0;
+    if (nodes[nodeIndex].count > 0)
+        candidates[candidateCount++] = nodeIndex; // Whole tree is a single leaf
+    else {
+        candidates[candidateCount++] = nodes[nodeIndex].offset;
+        candidates[candidateCount++] = nodes[nodeIndex].offset + 1;
+    }
+
+    while (candidateCount < BVH_WIDTH) {
+        int largest = -1;
+        float largestArea = -1.0f;
+        for (int i = 0; i < candidateCount; ++i) {
+            const Node & candidate = nodes[candidates[i]];
+            if (candidate.count == 0 && candidate.bounds.surfaceArea() > largestArea) {
+                largestArea = candidate.bounds.surfaceArea();
+                largest = i;
+            }
+        }
+        if (largest == -1)
+            break; // Only leaves left
+        int children = nodes[candidates[largest]].offset;
+        candidates[largest] = children;
+        candidates[candidateCount++] = children + 1;
+    }
+
+    WideNode wideNode;
+    AABB childBounds[BVH_WIDTH];
+    int interiorCount = 0;
+    wideNode.childBase = wideNodes.size();
+    wideNode.leafBase = leaves.size();
+    for (int i = 0; i < BVH_WIDTH; ++i) {
+        wideNode.leafSize[i] = 0;
+        if (i >= candidateCount)
+            continue;
+        const Node & candidate = nodes[candidates[i]];
+        childBounds[i] = candidate.bounds;
+        if (candidate.count > 0) {
+            wideNode.leafSize[i] = candidate.count;
+            Leaf leaf = {(int) trianglePrimitives.size(), (int) spherePrimitives.size(),
+                         (int) instancePrimitives.size(), 0, 0, 0};
+            for (int p = candidate.offset; p < candidate.offset + candidate.count; ++p) {
+                const Shape * shape = binaryPrimitives[p].shape;
+                if (dynamic_cast<const Triangle *>(shape)) {
+                    trianglePrimitives.push_back(binaryPrimitives[p]);
+                    ++leaf.triangleCount;
+                }
+                else if (dynamic_cast<const Sphere *>(shape)) {
+                    spherePrimitives.push_back(binaryPrimitives[p]);
+                    ++leaf.sphereCount;
+                }
+                else {
+                    instancePrimitives.push_back(binaryPrimitives[p]);
+                    ++leaf.instanceCount;
+                }
+            }
+            leaves.push_back(leaf);
+        }
+        else
+            ++interiorCount;
+    }
+    quantize(wideNode, childBounds, candidateCount);
+    wideNodes[wideIndex] = wideNode;
+
+    wideNodes.resize(wideNodes.size() + interiorCount);
+    int childIndex = wideNode.childBase;
+    for (int i = 0; i < candidateCount; ++i) {
+        if (nodes[candidates[i]].count == 0)
+            collapse(nodes, binaryPrimitives, candidates[i], childIndex++);
+    }
+}
+
+/* Sets the grid of the node and snaps the child boxes outwards onto it. The step along an axis is the
+smallest power of two that fits the node's box into 253 steps, which leaves room to pad every quantized
+bound by one more step so that rounding in the slab test can never cut into the real box. */
+void BVH::quantize(WideNode & wideNode, const AABB * childBounds, int childCount)
+{
+    AABB bounds;
+    for (int i = 0; i < childCount; ++i)
+        bounds.grow(childBounds[i]);
+
+    wideNode.childCount = childCount;
+    for (int axis = 0; axis < 3; ++axis) {
+        float origin = axisValue(bounds.min, axis);
+        float extent = axisValue(bounds.max, axis) - origin;
+        int exponent = -126;
+        if (extent > 0.0f) {
+            frexpf(extent / 253.0f, &exponent);
+            exponent = min(max(exponent, -126), 127);
+        }
+        float step = ldexpf(1.0f, exponent);
+
+        wideNode.origin[axis] = origin;
+        wideNode.exponent[axis] = exponent;
+        for (int i = 0; i < BVH_WIDTH; ++i) {
+            if (i >= childCount) {
+                wideNode.qMin[axis][i] = 0;
+                wideNode.qMax[axis][i] = 0;
+                continue;
+            }
+            // Children touching the node's min corner keep an exact bound, everything else is padded
+            float lo = floorf((axisValue(childBounds[i].min, axis) - origin) / step) - 1.0f;
+            float hi = ceilf((axisValue(childBounds[i].max, axis) - origin) / step) + 1.0f;
+            wideNode.qMin[axis][i] = (uint8_t) min(max(lo, 0.0f), 255.0f);
+            wideNode.qMax[axis][i] = (uint8_t) min(max(hi, 0.0f), 255.0f);
+        }
+    }
+}
+
+void BVH::refit(const Scene & scene)
+{
+    for (unique_ptr<BVH> & meshBVH : meshBVHs)
+        meshBVH->refit(scene);
+    if (!wideNodes.empty()) {
+        updateRecords(scene);
+        currentCost = refitNodes(scene);
+    }
+}
+
+// Recomputes the records of the primitives from the current vertex positions
+void BVH::updateRecords(const Scene & scene)
+{
+    int maxThreads = max(1u, thread::hardware_concurrency());
+    int numThreads = trianglePrimitives.size() >= parallelRangeSize ? maxThreads : 1;
+    parallelFor(0, trianglePrimitives.size(), numThreads, [this, &scene](int, int chunkBegin, int chunkEnd) {
+        for (int i = chunkBegin; i < chunkEnd; ++i)
+            triangles.set(i, static_cast<const Triangle *>(trianglePrimitives[i].shape)->getRecord(scene));
+    });
+    numThreads = spherePrimitives.size() >= parallelRangeSize ? maxThreads : 1;
+    parallelFor(0, spherePrimitives.size(), numThreads, [this, &scene](int, int chunkBegin, int chunkEnd) {
+        for (int i = chunkBegin; i < chunkEnd; ++i)
+            spheres.set(i, static_cast<const Sphere *>(spherePrimitives[i].shape)->getRecord(scene));
+    });
+}
+
+// The trees of instanced meshes are refitted along with this one, so the worst of them counts too
+float BVH::getDegradation() const
+{
+    float degradation = builtCost > 0.0f ? currentCost / builtCost : 1.0f;
+    for (const unique_ptr<BVH> & meshBVH : meshBVHs)
+        degradation = max(degradation, meshBVH->getDegradation());
+    return degradation;
+}
+
+/* Recomputes the child boxes of every wide node from the current primitive bounds and requantizes them.
+Nodes are grouped by depth and the levels are processed from the deepest up, each level in parallel, since
+a node only depends on its children. Returns the SAH cost of the tree relative to the area of its root. */
+float BVH::refitNodes(const Scene & scene)
+{
+    vector<vector<int>> levels(1, vector<int>(1, 0));
+    while (true) {
+        vector<int> next;
+        for (int index : levels.back()) {
+            const WideNode & node = wideNodes[index];
+            int childIndex = node.childBase;
+            for (int i = 0; i < node.childCount; ++i) {
+                if (node.leafSize[i] == 0)
+                    next.push_back(childIndex++);
+            }
+        }
+        if (next.empty())
+            break;
+        levels.push_back(move(next));
+    }
+
+    // Box of every node and the area weighted cost of its subtree
+    vector<AABB> nodeBounds(wideNodes.size());
+    vector<float> nodeCosts(wideNodes.size());
+    int maxThreads = max(1u, thread::hardware_concurrency());
+
+    for (int level = levels.size() - 1; level >= 0; --level) {
+        const vector<int> & indices = levels[level];
+        int numThreads = indices.size() >= parallelRefitSize ? maxThreads : 1;
+        parallelFor(0, indices.size(), numThreads, [&](int, int chunkBegin, int chunkEnd) {
+            for (int k = chunkBegin; k < chunkEnd; ++k) {
+                int index = indices[k];
+                WideNode & node = wideNodes[index];
+                AABB childBounds[BVH_WIDTH];
+                AABB bounds;
+                float cost = 0.0f;
+                int childIndex = node.childBase;
+                int leafIndex = node.leafBase;
+                for (int i = 0; i < node.childCount; ++i) {
+                    int leafSize = node.leafSize[i];
+                    if (leafSize > 0) {
+                        const Leaf & leaf = leaves[leafIndex++];
+                        for (int p = leaf.triangleBegin; p < leaf.triangleBegin + leaf.triangleCount; ++p)
+                            childBounds[i].grow(trianglePrimitives[p].shape->getBounds(scene));
+                        for (int p = leaf.sphereBegin; p < leaf.sphereBegin + leaf.sphereCount; ++p)
+                            childBounds[i].grow(spherePrimitives[p].shape->getBounds(scene));
+                        for (int p = leaf.instanceBegin; p < leaf.instanceBegin + leaf.instanceCount; ++p)
+                            childBounds[i].grow(instances[p].toWorld.transformBounds(instances[p].bvh->bounds));
+                        cost += intersectionCost * leafSize * childBounds[i].surfaceArea();
+                    }
+                    else {
+                        childBounds[i] = nodeBounds[childIndex];
+                        cost += nodeCosts[childIndex];
+                        ++childIndex;
+                    }
+                    bounds.grow(childBounds[i]);
+                }
+                quantize(node, childBounds, node.childCount);
+                nodeBounds[index] = bounds;
+                nodeCosts[index] = cost + traversalCost * bounds.surfaceArea();
+            }
+        });
+    }
+
+    bounds = nodeBounds[0];
+    float rootArea = nodeBounds[0].surfaceArea();
+    return rootArea > 0.0f ? nodeCosts[0] / rootArea : 0.0f;
+}
+
+size_t BVH::getNodeMemory() const
+{
+    size_t memory = wideNodes.size() * sizeof(WideNode) + leaves.size() * sizeof(Leaf);
+    for (const unique_ptr<BVH> & meshBVH : meshBVHs)
+        memory += meshBVH->getNodeMemory();
+    return memory;
+}
+
+size_t BVH::getBinaryNodeMemory() const
+{
+    size_t memory = binaryNodeMemory;
+    for (const unique_ptr<BVH> & meshBVH : meshBVHs)
+        memory += meshBVH->getBinaryNodeMemory();
+    return memory;
+}
+
+void BVH::makeLeaf(BuildState & state, int nodeIndex, int begin, int end)
+{
+    state.nodes[nodeIndex].offset = begin;
+    state.nodes[nodeIndex].count = end - begin;
+}
+
+/* Allocates the two children of the node and builds them over [begin, split) and [split, end).
+The binned builder hands big left subtrees to a new thread while there are idle cores. */
+void BVH::makeInterior(BuildState & state, int nodeIndex, int begin, int split, int end, int depth)
+{
+    int children = state.nodeCount.fetch_add(2);
+    state.nodes[nodeIndex].offset = children;
+    state.nodes[nodeIndex].count = 0;
+
+    if (state.method == SweepSAH) {
+        buildSweep(state, children, begin, split, depth + 1);
+        buildSweep(state, children + 1, split, end, depth + 1);
+        return;
+    }
+
+    int active = state.activeThreads.load();
+    if (end - begin >= parallelTaskSize && active < state.maxThreads &&
+            state.activeThreads.compare_exchange_strong(active, active + 1)) {
+        thread leftBuilder([this, &state, children, begin, split, depth]() {
+            buildBinned(state, children, begin, split, depth + 1);
+            --state.activeThreads;
+        });
+        buildBinned(state, children + 1, split, end, depth + 1);
+        leftBuilder.join();
+    }
+    else {
+        buildBinned(state, children, begin, split, depth + 1);
+        buildBinned(state, children + 1, split, end, depth + 1);
+    }
+}
+
+/* Ends a subtree that got close to maxDepth, which only happens with degenerate input such as primitives spaced
+further and further apart: the range is halved until it fits in a leaf, whatever the SAH says. */
+void BVH::buildMedian(BuildState & state, int nodeIndex, int begin, int end, int depth)
+{
+    if (end - begin <= maxLeafSize)
+        makeLeaf(state, nodeIndex, begin, end);
+    else
+        makeInterior(state, nodeIndex, begin, begin + (end - begin) / 2, end, depth);
+}
+
+/* Builds the subtree rooted at nodeIndex over prims[begin, end).
+For every axis the primitives are sorted by centroid and all split positions are swept,
+keeping the one with the lowest SAH cost. */
+void BVH::buildSweep(BuildState & state, int nodeIndex, int begin, int end, int depth)
+{
+    vector<BuildPrimitive> & buildPrims = state.prims;
+
+    AABB bounds;
+    for (int i = begin; i < end; ++i)
+        bounds.grow(buildPrims[i].bounds);
+    state.nodes[nodeIndex].bounds = bounds;
+
+    int count = end - begin;
+    if (depth >= maxDepth - medianLevels) {
+        buildMedian(state, nodeIndex, begin, end, depth);
+        return;
+    }
+    float parentArea = bounds.surfaceArea();
+    float leafCost = intersectionCost * count;
+
+    int bestAxis = -1;
+    int bestSplit = -1;
+    float bestCost = INF;
+
+    if (count > 1 && parentArea > 0.0f) {
+        vector<float> rightAreas(count);
+        for (int axis = 0; axis < 3; ++axis) {
+            sort(buildPrims.begin() + begin, buildPrims.begin() + end,
+                    [axis](const BuildPrimitive & a, const BuildPrimitive & b) {
+                        return axisValue(a.centroid, axis) < axisValue(b.centroid, axis);
+                    });
+
+            // Sweep from the right to get the area of every right-hand group
+            AABB rightBounds;
+            for (int i = count - 1; i > 0; --i) {
+                rightBounds.grow(buildPrims[begin + i].bounds);
+                rightAreas[i] = rightBounds.surfaceArea();
+            }
+            // Sweep from the left evaluating the cost of splitting before primitive i
+            AABB leftBounds;
+            for (int i = 1; i < count; ++i) {
+                leftBounds.grow(buildPrims[begin + i - 1].bounds);
+                float cost = traversalCost + intersectionCost *
+                        (leftBounds.surfaceArea() * i + rightAreas[i] * (count - i)) / parentArea;
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestSplit = begin + i;
+                }
+            }
+        }
+    }
+
+    if (bestAxis == -1 && count > maxLeafSize) {
+        // Every primitive has the same flat bounds, split in the middle to keep the tree balanced
+        bestAxis = 2;
+        bestSplit = begin + count / 2;
+    }
+    else if (bestCost >= leafCost && count > maxLeafSize) {
+        // Splitting does not pay off but the leaf would be too big, fall back to a median split
+        bestSplit = begin + count / 2;
+    }
+
+    if (bestAxis == -1 || (bestCost >= leafCost && count <= maxLeafSize)) {
+        makeLeaf(state, nodeIndex, begin, end);
+        return;
+    }
+
+    if (bestAxis != 2) {
+        sort(buildPrims.begin() + begin, buildPrims.begin() + end,
+                [bestAxis](const BuildPrimitive & a, const BuildPrimitive & b) {
+                    return axisValue(a.centroid, bestAxis) < axisValue(b.centroid, bestAxis);
+                });
+    }
+
+    makeInterior(state, nodeIndex, begin, bestSplit, end, depth);
+}
+
+/* Builds the subtree rooted at nodeIndex over prims[begin, end).
+Primitives are put into a fixed number of bins along each axis by their centroids and only the
+splits between bins are evaluated. Big ranges are binned and partitioned by all threads together. */
+void BVH::buildBinned(BuildState & state, int nodeIndex, int begin, int end, int depth)
+{
+    typedef struct Bin
+    {
+        AABB bounds;
+        int count = 0;
+    } Bin;
+
+    vector<BuildPrimitive> & buildPrims = state.prims;
+    int count = end - begin;
+    int numThreads = count >= parallelRangeSize ? state.maxThreads : 1;
+
+    // Bounds of the primitives and of their centroids
+    vector<AABB> chunkBounds(numThreads), chunkCentroidBounds(numThreads);
+    parallelFor(begin, end, numThreads, [&](int chunk, int chunkBegin, int chunkEnd) {
+        for (int i = chunkBegin; i < chunkEnd; ++i) {
+            chunkBounds[chunk].grow(buildPrims[i].bounds);
+            chunkCentroidBounds[chunk].grow(buildPrims[i].centroid);
+        }
+    });
+    AABB bounds, centroidBounds;
+    for (int chunk = 0; chunk < numThreads; ++chunk) {
+        bounds.grow(chunkBounds[chunk]);
+        centroidBounds.grow(chunkCentroidBounds[chunk]);
+    }
+    state.nodes[nodeIndex].bounds = bounds;
+
+    if (count == 1) {
+        makeLeaf(state, nodeIndex, begin, end);
+        return;
+    }
+    if (depth >= maxDepth - medianLevels) {
+        buildMedian(state, nodeIndex, begin, end, depth);
+        return;
+    }
+
+    Vector3f extent = centroidBounds.max - centroidBounds.min;
+    Vector3f binScale;
+    for (int axis = 0; axis < 3; ++axis) {
+        float axisExtent = axisValue(extent, axis);
+        (&binScale.x)[axis] = axisExtent > 0.0f ? binCount / axisExtent : 0.0f;
+    }
+    auto binIndex = [&centroidBounds, &binScale](const Vector3f & centroid, int axis) {
+        int index = (axisValue(centroid, axis) - axisValue(centroidBounds.min, axis)) * axisValue(binScale, axis);
+        return min(max(index, 0), binCount - 1);
+    };
+
+    // Fill the bins of all three axes in one pass
+    vector<Bin> chunkBins(numThreads * 3 * binCount);
+    parallelFor(begin, end, numThreads, [&](int chunk, int chunkBegin, int chunkEnd) {
+        Bin * bins = &chunkBins[chunk * 3 * binCount];
+        for (int i = chunkBegin; i < chunkEnd; ++i) {
+            for (int axis = 0; axis < 3; ++axis) {
+                Bin & bin = bins[axis * binCount + binIndex(buildPrims[i].centroid, axis)];
+                bin.bounds.grow(buildPrims[i].bounds);
+                ++bin.count;
+            }
+        }
+    });
+    Bin bins[3][binCount];
+    for (int chunk = 0; chunk < numThreads; ++chunk) {
+        for (int axis = 0; axis < 3; ++axis) {
+            for (int b = 0; b < binCount; ++b) {
+                const Bin & bin = chunkBins[(chunk * 3 + axis) * binCount + b];
+                bins[axis][b].bounds.grow(bin.bounds);
+                bins[axis][b].count += bin.count;
+            }
+        }
+    }
+
+    // Evaluate the splits between consecutive bins, left side holds bins [0, b)
+    float parentArea = bounds.surfaceArea();
+    float leafCost = intersectionCost * count;
+    int bestAxis = -1;
+    int bestBin = -1;
+    float bestCost = INF;
+    for (int axis = 0; axis < 3 && parentArea > 0.0f; ++axis) {
+        if (axisValue(binScale, axis) == 0.0f)
+            continue;
+        float rightAreas[binCount];
+        int rightCounts[binCount];
+        AABB rightBounds;
+        int rightCount = 0;
+        for (int b = binCount - 1; b > 0; --b) {
+            rightBounds.grow(bins[axis][b].bounds);
+            rightCount += bins[axis][b].count;
+            rightAreas[b] = rightBounds.surfaceArea();
+            rightCounts[b] = rightCount;
+        }
+        AABB leftBounds;
+        int leftCount = 0;
+        for (int b = 1; b < binCount; ++b) {
+            leftBounds.grow(bins[axis][b - 1].bounds);
+            leftCount += bins[axis][b - 1].count;
+            if (leftCount == 0 || rightCounts[b] == 0)
+                continue;
+            float cost = traversalCost + intersectionCost *
+                    (leftBounds.surfaceArea() * leftCount + rightAreas[b] * rightCounts[b]) / parentArea;
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestBin = b;
+            }
+        }
+    }
+
+    if (count <= maxLeafSize && (bestAxis == -1 || bestCost >= leafCost)) {
+        makeLeaf(state, nodeIndex, begin, end);
+        return;
+    }
+
+    if (bestAxis == -1) {
+        // Every centroid is at the same spot, any split is as good as the other
+        makeInterior(state, nodeIndex, begin, begin + count / 2, end, depth);
+        return;
+    }
+
+    // Partition the range so that primitives of the bins left of the split come first
+    int split;
+    if (numThreads == 1) {
+        split = partition(buildPrims.begin() + begin, buildPrims.begin() + end,
+                [&](const BuildPrimitive & prim) { return binIndex(prim.centroid, bestAxis) < bestBin; })
+                - buildPrims.begin();
+    }
+    else {
+        // Every chunk counts its left primitives, then scatters into scratch at its precomputed offsets
+        vector<int> chunkLeftCounts(numThreads), chunkBegins(numThreads + 1);
+        parallelFor(begin, end, numThreads, [&](int chunk, int chunkBegin, int chunkEnd) {
+            chunkBegins[chunk] = chunkBegin;
+            int leftCount = 0;
+            for (int i = chunkBegin; i < chunkEnd; ++i)
+                leftCount += binIndex(buildPrims[i].centroid, bestAxis) < bestBin;
+            chunkLeftCounts[chunk] = leftCount;
+        });
+        chunkBegins[numThreads] = end;
+
+        vector<int> leftOffsets(numThreads), rightOffsets(numThreads);
+        int totalLeft = 0;
+        for (int chunk = 0; chunk < numThreads; ++chunk)
+            totalLeft += chunkLeftCounts[chunk];
+        split = begin + totalLeft;
+        int leftOffset = begin;
+        int rightOffset = split;
+        for (int chunk = 0; chunk < numThreads; ++chunk) {
+            leftOffsets[chunk] = leftOffset;
+            rightOffsets[chunk] = rightOffset;
+            leftOffset += chunkLeftCounts[chunk];
+            rightOffset += (chunkBegins[chunk + 1] - chunkBegins[chunk]) - chunkLeftCounts[chunk];
+        }
+
+        vector<BuildPrimitive> & scratch = state.scratch;
+        parallelFor(begin, end, numThreads, [&](int chunk, int chunkBegin, int chunkEnd) {
+            int left = leftOffsets[chunk];
+            int right = rightOffsets[chunk];
+            for (int i = chunkBegin; i < chunkEnd; ++i) {
+                if (binIndex(buildPrims[i].centroid, bestAxis) < bestBin)
+                    scratch[left++] = buildPrims[i];
+                else
+                    scratch[right++] = buildPrims[i];
+            }
+        });
+        parallelFor(begin, end, numThreads, [&](int, int chunkBegin, int chunkEnd) {
+            copy(scratch.begin() + chunkBegin, scratch.begin() + chunkEnd, buildPrims.begin() + chunkBegin);
+        });
+    }
+
+    if (split == begin || split == end)
+        split = begin + count / 2; // Rounding put everything on one side
+
+    makeInterior(state, nodeIndex, begin, split, end, depth);
+}
+
+static inline float stepFromExponent(int exponent)
+{
+    // 2^exponent built directly from its bits, exponent is always in the normal range
+    uint32_t bits = (uint32_t) (exponent + 127) << 23;
+    float step;
+    memcpy(&step, &bits, sizeof(step));
+    return step;
+}
+
+/* Slab test of the ray against every child box of the node at once. Writes the distance at which the ray
+enters each child to tNear and returns a bit mask of the children that are entered no later than maxT.
+A quantized bound q along an axis is at origin + q * step, so its distance along the ray is a + q * b with
+a = (origin - rayOrigin) * invDir and b = step * invDir computed once per node and axis.
+NaNs produced by rays lying on a slab plane are ignored by the order of the min/max operands, and the exit
+distance and maxT are scaled up a little so that rounding neither makes flat boxes (e.g. of axis aligned
+triangles) miss rays that hit them exactly at their edges, nor culls a box holding an equally near hit. */
+inline int BVH::intersectChildren(const WideNode & node, const Vector3f & origin, const Vector3f & invDir,
+        float maxT, float * tNear)
+{
+    float a[3], b[3];
+    for (int axis = 0; axis < 3; ++axis) {
+        a[axis] = (node.origin[axis] - axisValue(origin, axis)) * axisValue(invDir, axis);
+        b[axis] = stepFromExponent(node.exponent[axis]) * axisValue(invDir, axis);
+    }
+    int validMask = (1 << node.childCount) - 1;
+
+#if defined(__AVX2__)
+    __m256 near = _mm256_setzero_ps();
+    __m256 far = _mm256_set1_ps(INF);
+    for (int axis = 0; axis < 3; ++axis) {
+        __m256 qMin = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) node.qMin[axis])));
+        __m256 qMax = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) node.qMax[axis])));
+        __m256 axisA = _mm256_set1_ps(a[axis]);
+        __m256 axisB = _mm256_set1_ps(b[axis]);
+        __m256 t0 = _mm256_add_ps(axisA, _mm256_mul_ps(qMin, axisB));
+        __m256 t1 = _mm256_add_ps(axisA, _mm256_mul_ps(qMax, axisB));
+        near = _mm256_max_ps(_mm256_min_ps(t0, t1), near);
+        far = _mm256_min_ps(_mm256_max_ps(t0, t1), far);
+    }
+    far = _mm256_mul_ps(far, _mm256_set1_ps(robustScale));
+    __m256 hit = _mm256_and_ps(_mm256_cmp_ps(near, far, _CMP_LE_OQ),
+            _mm256_cmp_ps(near, _mm256_set1_ps(maxT * robustScale), _CMP_LE_OQ));
+    _mm256_storeu_ps(tNear, near);
+    return _mm256_movemask_ps(hit) & validMask;
+#elif defined(__SSE2__)
+    __m128 near = _mm_setzero_ps();
+    __m128 far = _mm_set1_ps(INF);
+    __m128i zero = _mm_setzero_si128();
+    for (int axis = 0; axis < 3; ++axis) {
+        int32_t packedMin, packedMax;
+        memcpy(&packedMin, node.qMin[axis], sizeof(packedMin));
+        memcpy(&packedMax, node.qMax[axis], sizeof(packedMax));
+        __m128i bytesMin = _mm_unpacklo_epi8(_mm_cvtsi32_si128(packedMin), zero);
+        __m128i bytesMax = _mm_unpacklo_epi8(_mm_cvtsi32_si128(packedMax), zero);
+        __m128 qMin = _mm_cvtepi32_ps(_mm_unpacklo_epi16(bytesMin, zero));
+        __m128 qMax = _mm_cvtepi32_ps(_mm_unpacklo_epi16(bytesMax, zero));
+        __m128 axisA = _mm_set1_ps(a[axis]);
+        __m128 axisB = _mm_set1_ps(b[axis]);
+        __m128 t0 = _mm_add_ps(axisA, _mm_mul_ps(qMin, axisB));
+        __m128 t1 = _mm_add_ps(axisA, _mm_mul_ps(qMax, axisB));
+        near = _mm_max_ps(_mm_min_ps(t0, t1), near);
+        far = _mm_min_ps(_mm_max_ps(t0, t1), far);
+    }
+    far = _mm_mul_ps(far, _mm_set1_ps(robustScale));
+    __m128 hit = _mm_and_ps(_mm_cmple_ps(near, far), _mm_cmple_ps(near, _mm_set1_ps(maxT * robustScale)));
+    _mm_storeu_ps(tNear, near);
+    return _mm_movemask_ps(hit) & validMask;
+#else
+    int hitMask = 0;
+    for (int i = 0; i < node.childCount; ++i) {
+        float near = 0.0f;
+        float far = INF;
+        for (int axis = 0; axis < 3; ++axis) {
+            float t0 = a[axis] + node.qMin[axis][i] * b[axis];
+            float t1 = a[axis] + node.qMax[axis][i] * b[axis];
+            near = max(min(t0, t1), near);
+            far = min(max(t0, t1), far);
+        }
+        far *= robustScale;
+        tNear[i] = near;
+        if (near <= far && near <= maxT * robustScale)
+            hitMask |= 1 << i;
+    }
+    return hitMask;
+#endif
+}
+
+/* Updates the nearest hit of the ray with the primitives of the leaf. Ties between equally near hits go to
+the primitive that comes first in the flattened scene. Only the distance and the primitive are recorded, the
+surface is computed by getSurface once the nearest hit is known. */
+inline void BVH::intersectLeaf(const Ray & ray, const Leaf & leaf, Hit & nearest) const
+{
+    int end = leaf.triangleBegin + leaf.triangleCount;
+    for (int first = leaf.triangleBegin; first < end; first += TRIANGLE_BLOCK_WIDTH) {
+        float t[TRIANGLE_BLOCK_WIDTH];
+        int hitMask = triangles.intersectBlock(ray, first, t) &
+                ((1 << min(TRIANGLE_BLOCK_WIDTH, end - first)) - 1);
+        for (int lane = 0; hitMask; ++lane, hitMask >>= 1) {
+            int i = first + lane;
+            if (!(hitMask & 1))
+                continue;
+            int index = trianglePrimitives[i].index;
+            if (t[lane] < nearest.t || (t[lane] == nearest.t && index < nearest.index))
+                nearest = {t[lane], index, i, false, -1};
+        }
+    }
+    end = leaf.sphereBegin + leaf.sphereCount;
+    for (int first = leaf.sphereBegin; first < end; first += SPHERE_BLOCK_WIDTH) {
+        float t[SPHERE_BLOCK_WIDTH];
+        int hitMask = spheres.intersectBlock(ray, first, t) &
+                ((1 << min(SPHERE_BLOCK_WIDTH, end - first)) - 1);
+        for (int lane = 0; hitMask; ++lane, hitMask >>= 1) {
+            int i = first + lane;
+            if (!(hitMask & 1))
+                continue;
+            int index = spherePrimitives[i].index;
+            if (t[lane] < nearest.t || (t[lane] == nearest.t && index < nearest.index))
+                nearest = {t[lane], index, i, true, -1};
+        }
+    }
+    // The ray is taken to object space without normalizing its direction, so distances along it stay the same
+    end = leaf.instanceBegin + leaf.instanceCount;
+    for (int i = leaf.instanceBegin; i < end; ++i) {
+        const InstanceRecord & instance = instances[i];
+        Ray objectRay(instance.toObject.transformPoint(ray.origin), instance.toObject.transformVector(ray.direction));
+        Hit objectHit = {nearest.t, INT_MAX, -1, false, -1};
+        instance.bvh->intersectNearest(objectRay, objectHit);
+        int index = instancePrimitives[i].index;
+        if (objectHit.slot >= 0 && (objectHit.t < nearest.t || (objectHit.t == nearest.t && index < nearest.index)))
+            nearest = {objectHit.t, index, objectHit.slot, false, i};
+    }
+}
+
+// Whether any primitive of the leaf is hit closer than tMax
+// Occluders are the slot of a primitive times four plus its type: 0 for triangles, 1 for spheres and 2 for instances
+static inline int triangleOccluder(int slot) { return 4 * slot; }
+static inline int sphereOccluder(int slot) { return 4 * slot + 1; }
+static inline int instanceOccluder(int slot) { return 4 * slot + 2; }
+
+// Whether the mesh of the instance in slot is hit closer than tMax
+inline bool BVH::occludedInstance(const Ray & ray, float tMax, int slot) const
+{
+    const InstanceRecord & instance = instances[slot];
+    Ray objectRay(instance.toObject.transformPoint(ray.origin), instance.toObject.transformVector(ray.direction));
+    int occluder;
+    return instance.bvh->occluded(objectRay, tMax, occluder);
+}
+
+inline bool BVH::occludedLeaf(const Ray & ray, const Leaf & leaf, float tMax, int & occluder) const
+{
+    int end = leaf.triangleBegin + leaf.triangleCount;
+    for (int first = leaf.triangleBegin; first < end; first += TRIANGLE_BLOCK_WIDTH) {
+        float t[TRIANGLE_BLOCK_WIDTH];
+        int hitMask = triangles.intersectBlock(ray, first, t) &
+                ((1 << min(TRIANGLE_BLOCK_WIDTH, end - first)) - 1);
+        for (int lane = 0; hitMask; ++lane, hitMask >>= 1) {
+            if ((hitMask & 1) && t[lane] < tMax) {
+                occluder = triangleOccluder(first + lane);
+                return true;
+            }
+        }
+    }
+    end = leaf.sphereBegin + leaf.sphereCount;
+    for (int first = leaf.sphereBegin; first < end; first += SPHERE_BLOCK_WIDTH) {
+        float t[SPHERE_BLOCK_WIDTH];
+        int hitMask = spheres.intersectBlock(ray, first, t) &
+                ((1 << min(SPHERE_BLOCK_WIDTH, end - first)) - 1);
+        for (int lane = 0; hitMask; ++lane, hitMask >>= 1) {
+            if ((hitMask & 1) && t[lane] < tMax) {
+                occluder = sphereOccluder(first + lane);
+                return true;
+            }
+        }
+    }
+    end = leaf.instanceBegin + leaf.instanceCount;
+    for (int i = leaf.instanceBegin; i < end; ++i) {
+        if (occludedInstance(ray, tMax, i)) {
+            occluder = instanceOccluder(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Normal and material at the hit, nullIntersect if the ray hit nothing. The normal of a face of an instance is taken
+to world space by the inverse transpose of the instance's transform, and the face gets the material of the instance. */
+inline IntersectionData BVH::getSurface(const Ray & ray, const Hit & hit) const
+{
+    if (hit.index < 0)
+        return nullIntersect;
+    if (hit.instance >= 0) {
+        const InstanceRecord & instance = instances[hit.instance];
+        IntersectionData data = instance.bvh->triangles.getIntersection(hit.slot, hit.t);
+        data.normal = normalize(instance.toObject.transposeVector(data.normal));
+        data.materialId = instance.materialId;
+        return data;
+    }
+    if (hit.isSphere)
+        return spheres.getIntersection(hit.slot, ray, hit.t);
+    return triangles.getIntersection(hit.slot, hit.t);
+}
+
+IntersectionData BVH::intersect(const Ray & ray) const
+{
+    Hit nearest = noHit;
+    intersectNearest(ray, nearest);
+    return getSurface(ray, nearest);
+}
+
+// Updates nearest with the primitives hit no farther than it, as intersectLeaf does for a single leaf
+void BVH::intersectNearest(const Ray & ray, Hit & nearest) const
+{
+    if (wideNodes.empty())
+        return;
+
+    Vector3f invDir = {1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z};
+
+    // Postponed children together with the distance at which the ray enters them, nearest on top
+    typedef struct StackEntry
+    {
+        int child;
+        int leafSize;
+        float t;
+    } StackEntry;
+    StackEntry stack[maxStackSize];
+    int stackSize = 0;
+    stack[stackSize++] = {0, 0, 0.0f};
+
+    while (stackSize > 0) {
+        StackEntry entry = stack[--stackSize];
+        // Skip children that cannot hold anything as near as the current hit
+        if (entry.t > nearest.t * robustScale)
+            continue;
+
+        if (entry.leafSize > 0) {
+            intersectLeaf(ray, leaves[entry.child], nearest);
+            continue;
+        }
+
+        const WideNode & node = wideNodes[entry.child];
+        float tNear[BVH_WIDTH];
+        int hitMask = intersectChildren(node, ray.origin, invDir, nearest.t, tNear);
+
+        // Push the children that were hit sorted by distance, farthest first
+        int first = stackSize;
+        int childIndex = node.childBase;
+        int leafIndex = node.leafBase;
+        for (int i = 0; i < node.childCount; ++i) {
+            int leafSize = node.leafSize[i];
+            int child = leafSize > 0 ? leafIndex++ : childIndex++;
+            if (!(hitMask & (1 << i)))
+                continue;
+
+            StackEntry pushed = {child, leafSize, tNear[i]};
+            int j = stackSize++;
+            while (j > first && stack[j - 1].t < pushed.t) {
+                stack[j] = stack[j - 1];
+                --j;
+            }
+            stack[j] = pushed;
+        }
+    }
+}
+
+bool BVH::occluded(const Ray & ray, float tMax) const
+{
+    int occluder;
+    return occluded(ray, tMax, occluder);
+}
+
+/* The primitives after the occluder in its array mostly come from the same leaf, so the whole block starting at it
+is tested, which costs as much as testing the occluder alone. Padding past the end of the arrays is never hit.
+An instance is tested whole, its tree remembering no occluder of its own. */
+bool BVH::occludedBy(const Ray & ray, float tMax, int occluder) const
+{
+    int slot = occluder >> 2;
+    int type = occluder & 3;
+    if (occluder < 0 || type == 3)
+        return false;
+    if (type == 2)
+        return slot < (int) instances.size() && occludedInstance(ray, tMax, slot);
+    if (slot >= (type == 1 ? spheres.size() : triangles.size()))
+        return false;
+
+    if (type == 1) {
+        float t[SPHERE_BLOCK_WIDTH];
+        int hitMask = spheres.intersectBlock(ray, slot, t);
+        for (int lane = 0; hitMask; ++lane, hitMask >>= 1) {
+            if ((hitMask & 1) && t[lane] < tMax)
+                return true;
+        }
+    }
+    else {
+        float t[TRIANGLE_BLOCK_WIDTH];
+        int hitMask = triangles.intersectBlock(ray, slot, t);
+        for (int lane = 0; hitMask; ++lane, hitMask >>= 1) {
+            if ((hitMask & 1) && t[lane] < tMax)
+                return true;
+        }
+    }
+    return false;
+}
+
+bool BVH::occluded(const Ray & ray, float tMax, int & occluder) const
+{
+    if (wideNodes.empty())
+        return false;
+
+    Vector3f invDir = {1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z};
+
+    // Any hit ends the query, so children are visited in whatever order they come and no distances are kept
+    typedef struct StackEntry
+    {
+        int child;
+        int leafSize;
+    } StackEntry;
+    StackEntry stack[maxStackSize];
+    int stackSize = 0;
+    stack[stackSize++] = {0, 0};
+
+    while (stackSize > 0) {
+        StackEntry entry = stack[--stackSize];
+
+        if (entry.leafSize > 0) {
+            if (occludedLeaf(ray, leaves[entry.child], tMax, occluder))
+                return true;
+            continue;
+        }
+
+        const WideNode & node = wideNodes[entry.child];
+        float tNear[BVH_WIDTH];
+        int hitMask = intersectChildren(node, ray.origin, invDir, tMax, tNear);
+
+        int childIndex = node.childBase;
+        int leafIndex = node.leafBase;
+        for (int i = 0; i < node.childCount; ++i) {
+            int leafSize = node.leafSize[i];
+            int child = leafSize > 0 ? leafIndex++ : childIndex++;
+            if (hitMask & (1 << i))
+                stack[stackSize++] = {child, leafSize};
+        }
+    }
+
+    return false;
+}
+
+/* Conservative test of a packet of rays against every child box of the node at once, using the bounds of the
+origins and inverse directions of the rays in the packet. Along an axis each ray enters and leaves a slab at the
+distances (bound - origin) * invDir, so interval arithmetic over the packet bounds gives a lower bound of the
+distance at which any ray of the packet enters a child and an upper bound of where it leaves. A child is culled
+when no ray of the packet can pass through it no later than maxT. The boxes are widened by half a grid step so that
+the rounding of their world space bounds never culls a child that a single ray would enter. */
+inline int BVH::intersectChildrenPacket(const WideNode & node, const PacketBounds & packet, float maxT, float * tNear)
+{
+    float enter[BVH_WIDTH], exit[BVH_WIDTH];
+    for (int i = 0; i < BVH_WIDTH; ++i) {
+        enter[i] = 0.0f;
+        exit[i] = INF;
+    }
+
+    for (int axis = 0; axis < 3; ++axis) {
+        float step = stepFromExponent(node.exponent[axis]);
+        float invMin = packet.invDirMin[axis], invMax = packet.invDirMax[axis];
+        for (int i = 0; i < BVH_WIDTH; ++i) {
+            float lo = node.origin[axis] + (node.qMin[axis][i] - 0.5f) * step;
+            float hi = node.origin[axis] + (node.qMax[axis][i] + 0.5f) * step;
+            // Distances to the slab planes are products of the intervals [bound - originMax, bound - originMin]
+            // and [invMin, invMax], bounded by the products of their ends
+            float loNear = lo - packet.originMax[axis], loFar = lo - packet.originMin[axis];
+            float hiNear = hi - packet.originMax[axis], hiFar = hi - packet.originMin[axis];
+            float a = loNear * invMin, b = loNear * invMax, c = loFar * invMin, d = loFar * invMax;
+            float e = hiNear * invMin, f = hiNear * invMax, g = hiFar * invMin, h = hiFar * invMax;
+            float lower = min(min(min(a, b), min(c, d)), min(min(e, f), min(g, h)));
+            float upper = max(max(max(a, b), max(c, d)), max(max(e, f), max(g, h)));
+            enter[i] = max(enter[i], lower);
+            exit[i] = min(exit[i], upper);
+        }
+    }
+
+    int hitMask = 0;
+    for (int i = 0; i < node.childCount; ++i) {
+        tNear[i] = enter[i];
+        if (enter[i] <= exit[i] * robustScale && enter[i] <= maxT * robustScale)
+            hitMask |= 1 << i;
+    }
+    return hitMask;
+}
+
+void BVH::intersectPacket(const Ray * rays, int count, IntersectionData * hits) const
+{
+    PacketBounds packet;
+    for (int axis = 0; axis < 3; ++axis) {
+        packet.originMin[axis] = packet.invDirMin[axis] = INF;
+        packet.originMax[axis] = packet.invDirMax[axis] = -INF;
+    }
+    bool finite = true;
+    for (int r = 0; r < count; ++r) {
+        for (int axis = 0; axis < 3; ++axis) {
+            float origin = axisValue(rays[r].origin, axis);
+            float invDir = 1.0f / axisValue(rays[r].direction, axis);
+            finite = finite && fabs(invDir) <= INF;
+            packet.originMin[axis] = min(packet.originMin[axis], origin);
+            packet.originMax[axis] = max(packet.originMax[axis], origin);
+            packet.invDirMin[axis] = min(packet.invDirMin[axis], invDir);
+            packet.invDirMax[axis] = max(packet.invDirMax[axis], invDir);
+        }
+    }
+
+    // The interval bounds are meaningless for rays parallel to an axis, those packets are traced ray by ray
+    if (wideNodes.empty() || !finite || count > maxPacketSize) {
+        for (int r = 0; r < count; ++r)
+            hits[r] = intersect(rays[r]);
+        return;
+    }
+
+    Hit nearest[maxPacketSize];
+    for (int r = 0; r < count; ++r)
+        nearest[r] = noHit;
+    // Farthest nearest hit over the packet, a child entered later than it cannot improve any hit
+    float maxT = INF;
+
+    typedef struct StackEntry
+    {
+        int child;
+        int leafSize;
+        float t;
+    } StackEntry;
+    StackEntry stack[maxStackSize];
+    int stackSize = 0;
+    stack[stackSize++] = {0, 0, 0.0f};
+
+    while (stackSize > 0) {
+        StackEntry entry = stack[--stackSize];
+        if (entry.t > maxT * robustScale)
+            continue;
+
+        if (entry.leafSize > 0) {
+            maxT = 0.0f;
+            for (int r = 0; r < count; ++r) {
+                // Rays that already hit something nearer than where the packet can enter the leaf skip it
+                if (entry.t <= nearest[r].t * robustScale)
+                    intersectLeaf(rays[r], leaves[entry.child], nearest[r]);
+                maxT = max(maxT, nearest[r].t);
+            }
+            continue;
+        }
+
+        const WideNode & node = wideNodes[entry.child];
+        float tNear[BVH_WIDTH];
+        int hitMask = intersectChildrenPacket(node, packet, maxT, tNear);
+
+        // Push the children that were hit sorted by distance, farthest first
+        int first = stackSize;
+        int childIndex = node.childBase;
+        int leafIndex = node.leafBase;
+        for (int i = 0; i < node.childCount; ++i) {
+            int leafSize = node.leafSize[i];
+            int child = leafSize > 0 ? leafIndex++ : childIndex++;
+            if (!(hitMask & (1 << i)))
+                continue;
+
+            StackEntry pushed = {child, leafSize, tNear[i]};
+            int j = stackSize++;
+            while (j > first && stack[j - 1].t < pushed.t) {
+                stack[j] = stack[j - 1];
+                --j;
+            }
+            stack[j] = pushed;
+        }
+    }
+
+    for (int r = 0; r < count; ++r)
+        hits[r] = getSurface(rays[r], nearest[r]);
+}
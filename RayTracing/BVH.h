@@ -0,0 +1,209 @@
+#ifndef _BVH_H_
+#define _BVH_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include "Ray.h"
+#include "Shape.h"
+#include "SphereArray.h"
+#include "TriangleArray.h"
+#include "defs.h"
+
+using namespace std;
+
+// Number of children of the nodes that rays traverse, matches the widest SIMD registers available
+#if defined(__AVX2__)
+#define BVH_WIDTH 8
+#else
+#define BVH_WIDTH 4
+#endif
+
+/* Bounding volume hierarchy over every primitive of the scene. Spheres, standalone triangles and the faces
+of meshes are flattened into one primitive set and organized into a binary tree built with the surface area
+heuristic (SAH), so that a ray only visits the primitives whose boxes it actually pierces.
+The binary tree is then collapsed into a BVH_WIDTH wide tree with compressed child boxes for traversal.
+Instances are primitives of this tree too, each instanced mesh getting a tree of its own over its faces that all of
+its instances share: a ray reaching an instance is taken to the instance's object space and traverses that tree. */
+class BVH
+{
+public:
+    enum BuildMethod
+    {
+        SweepSAH,   // Full quality: evaluates every split position, serial
+        BinnedSAH   // Fast: evaluates a fixed number of bins per axis, builds subtrees in parallel
+    };
+
+    BVH(const Scene & scene, BuildMethod method = SweepSAH);  // Flattens the objects of the scene and builds the hierarchy over them
+
+    IntersectionData intersect(const Ray & ray) const; // Returns the nearest intersection along the ray
+    bool occluded(const Ray & ray, float tMax) const;  // Returns true as soon as any primitive is hit closer than tMax
+    // Same as occluded, also writes to occluder which primitive blocked the ray, to be tried first by later queries
+    bool occluded(const Ray & ray, float tMax, int & occluder) const;
+    // Tests only the block of primitives starting at an occluder given by occluded, without any traversal. Any
+    // value is accepted, the block is just not tested when it no longer exists since the tree was rebuilt.
+    bool occludedBy(const Ray & ray, float tMax, int occluder) const;
+    // Nearest intersections of a packet of up to maxPacketSize coherent rays, e.g. the primary rays of a block of
+    // pixels. The packet shares one traversal, whole subtrees outside the frustum of the packet are skipped at once.
+    // Gives the same hits as intersect for each ray.
+    void intersectPacket(const Ray * rays, int count, IntersectionData * hits) const;
+
+    static const int maxPacketSize = 64;
+
+    void refit(const Scene & scene);  // Recomputes every box bottom-up after the vertices of the scene moved, keeping the tree as it is
+    float getDegradation() const;  // SAH cost of the tree relative to its cost right after the build, the worst one of it and the trees of instanced meshes
+
+    size_t getNodeMemory() const;       // Bytes used by the nodes of the wide tree, and of the trees of instanced meshes
+    size_t getBinaryNodeMemory() const; // Bytes used by the binary tree with float boxes the wide tree was collapsed from
+
+private:
+    friend class SceneFile;     // Saves the tree and restores it through the empty constructor
+    BVH();
+
+    /* Traversal keeps the children it postpones on a fixed stack: at most BVH_WIDTH - 1 per level above the node being
+    visited, plus the BVH_WIDTH children of that node. Trees are built at most maxDepth levels deep so that this
+    always fits, and trees read from scene files are checked against it. */
+    static const int maxStackSize = 1024;
+    static const int maxDepth = (maxStackSize - BVH_WIDTH) / (BVH_WIDTH - 1);
+    BVH(const Scene & scene, const Mesh & mesh, BuildMethod method);   // Tree over the faces of an instanced mesh
+
+    // Node of the binary tree produced by the builders. Both children of an interior node are stored next to each other.
+    typedef struct Node
+    {
+        AABB bounds;
+        int offset;     // Interior: index of the left child, the right child follows it. Leaf: index of the first primitive
+        int count;      // Number of primitives in the leaf, 0 for interior nodes
+    } Node;
+
+    // Shape of a primitive and its position in the flattened scene. The index breaks ties between equally near hits
+    // the same way a linear scan over the objects would.
+    typedef struct Primitive
+    {
+        const Shape * shape;
+        int index;
+    } Primitive;
+
+    // Nearest hit found so far by a traversal: its distance and which primitive it is
+    typedef struct Hit
+    {
+        float t;
+        int index;      // Flattened index of the primitive, -1 for no hit
+        int slot;       // Position of the primitive in spheres or triangles
+        bool isSphere;
+        int instance;   // Slot of the instance whose mesh holds the triangle, which is then in the tree of that
+                        // mesh, -1 for primitives of this tree
+    } Hit;
+
+    // Build time data of a primitive
+    typedef struct BuildPrimitive
+    {
+        AABB bounds;
+        Vector3f centroid;
+        Primitive primitive;
+    } BuildPrimitive;
+
+    /* Node of the wide tree. Child boxes are quantized to 8 bits on a grid anchored at the min corner of the node's box,
+    with a power of two step per axis, so that all children are tested against a ray with a single SIMD slab test.
+    Wide node children are stored next to each other starting at childBase, and so are the leaves of all leaf
+    children starting at leafBase, so a child is located by counting the children before it. */
+    typedef struct WideNode
+    {
+        float origin[3];                // Min corner of the node's box
+        int8_t exponent[3];             // Grid step along each axis is 2^exponent
+        uint8_t childCount;
+        uint8_t qMin[3][BVH_WIDTH];     // Quantized child boxes, [axis][child]
+        uint8_t qMax[3][BVH_WIDTH];
+        uint8_t leafSize[BVH_WIDTH];    // Number of primitives of a leaf child, 0 for wide node children
+        int childBase;
+        int leafBase;
+    } WideNode;
+
+    // Primitives of a leaf child, split by type into a range of the triangles, of the spheres and of the instances
+    typedef struct Leaf
+    {
+        int triangleBegin;
+        int sphereBegin;
+        int instanceBegin;
+        uint8_t triangleCount;
+        uint8_t sphereCount;
+        uint8_t instanceCount;
+    } Leaf;
+
+    // Instance prepared for traversal: its transforms and the tree over its mesh
+    typedef struct InstanceRecord
+    {
+        Transform toObject;
+        Transform toWorld;
+        const BVH * bvh;
+        int materialId;
+    } InstanceRecord;
+
+    // Bounds of the origins and inverse directions of the rays of a packet, [axis]
+    typedef struct PacketBounds
+    {
+        float originMin[3];
+        float originMax[3];
+        float invDirMin[3];
+        float invDirMax[3];
+    } PacketBounds;
+
+    // State shared by the subtrees of a build, possibly running on different threads
+    typedef struct BuildState
+    {
+        vector<Node> nodes;             // Binary tree
+        vector<BuildPrimitive> prims;   // Reordered in place so that every subtree owns a contiguous range
+        vector<BuildPrimitive> scratch; // Temporary storage for parallel partitioning
+        atomic<int> nodeCount;          // Nodes allocated so far
+        atomic<int> activeThreads;      // Threads currently building subtrees
+        BuildMethod method;
+        int maxThreads;
+    } BuildState;
+
+    /* The primitives are compiled into one contiguous array per type, ordered so that every leaf references a
+    range of each, and each range is tested with the kernel of its type. Nothing in traversal goes through a
+    Shape, the shapes are only kept to update the records when the vertices move. */
+    vector<WideNode> wideNodes;             // Root is the first node
+    vector<Leaf> leaves;
+    TriangleArray triangles;                // Standalone triangles and mesh faces, tested in SIMD blocks
+    SphereArray spheres;                    // Likewise
+    vector<Primitive> trianglePrimitives;   // Shape and flattened index of each element of triangles
+    vector<Primitive> spherePrimitives;     // Likewise for spheres
+    vector<InstanceRecord> instances;
+    vector<Primitive> instancePrimitives;
+    vector<unique_ptr<BVH>> meshBVHs;       // Trees over the faces of the instanced meshes
+    vector<const Mesh *> instancedMeshes;   // Mesh of each of meshBVHs
+    unordered_map<const Mesh *, const BVH *> meshBVHsByMesh;
+    AABB bounds;                  // Box of the whole tree
+    size_t binaryNodeMemory;
+    float builtCost;              // SAH cost right after the build
+    float currentCost;            // SAH cost after the last refit
+
+    void build(const Scene & scene, const vector<const Shape *> & shapes, BuildMethod method);
+    float refitNodes(const Scene & scene);
+    void updateRecords(const Scene & scene);
+    void setInstanceRecords();
+    void addMeshBVH(const Mesh * mesh, BVH * meshBVH);
+    const BVH * getMeshBVH(const Mesh * mesh) const;
+
+    void collapse(const vector<Node> & nodes, const vector<Primitive> & binaryPrimitives, int nodeIndex, int wideIndex);
+    static void quantize(WideNode & wideNode, const AABB * childBounds, int childCount);
+    static int intersectChildren(const WideNode & node, const Vector3f & origin, const Vector3f & invDir,
+            float maxT, float * tNear);
+    static int intersectChildrenPacket(const WideNode & node, const PacketBounds & packet, float maxT, float * tNear);
+    void intersectNearest(const Ray & ray, Hit & nearest) const;
+    void intersectLeaf(const Ray & ray, const Leaf & leaf, Hit & nearest) const;
+    bool occludedInstance(const Ray & ray, float tMax, int slot) const;
+    IntersectionData getSurface(const Ray & ray, const Hit & hit) const;
+    bool occludedLeaf(const Ray & ray, const Leaf & leaf, float tMax, int & occluder) const;
+
+    void makeLeaf(BuildState & state, int nodeIndex, int begin, int end);
+    void makeInterior(BuildState & state, int nodeIndex, int begin, int split, int end, int depth);
+    void buildSweep(BuildState & state, int nodeIndex, int begin, int end, int depth);
+    void buildBinned(BuildState & state, int nodeIndex, int begin, int end, int depth);
+    void buildMedian(BuildState & state, int nodeIndex, int begin, int end, int depth);
+};
+
+#endif
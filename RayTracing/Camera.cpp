@@ -1,3 +1,4 @@
+#include <cmath>
 #include <cstring>
 #include "Camera.h"
 #include "helpers.h"
@@ -16,6 +17,23 @@ Camera::Camera(int id,                      // Id of the camera
 	 this->gaze = gaze;
 	 this->up = up;
 	 this->right = crossProduct(gaze, up);
+
+	 // The image plane does not move, so its corner is computed once instead of for every pixel
+	 this->imageCenter = pos + (gaze * imgPlane.distance); // m
+	 this->topLeft = imageCenter + (right * imgPlane.left) + (up * imgPlane.top); // q
+}
+
+// Largest image side accepted, so that the pixel count of an image stays well within an int
+static const int maxResolution = 1 << 15;
+
+bool Camera::isValid() const
+{
+    const ImagePlane & plane = this->imgPlane;
+    return memchr(this->imageName, '\0', sizeof(this->imageName)) && this->imageName[0] != '\0' &&
+           plane.nx > 0 && plane.nx <= maxResolution && plane.ny > 0 && plane.ny <= maxResolution &&
+           plane.left < plane.right && plane.bottom < plane.top && plane.distance > 0.0f &&
+           std::isfinite(plane.left) && std::isfinite(plane.right) && std::isfinite(plane.bottom) && std::isfinite(plane.top) &&
+           std::isfinite(plane.distance);
 }
 
 /* Takes coordinate of an image pixel as row and col, and
@@ -29,12 +47,10 @@ Ray Camera::getPrimaryRay(int row, int col) const
     /* d = s - e */
 
     Vector3f origin = this->pos; // e
-    Vector3f imageCenter = origin + (this->gaze * this->imgPlane.distance); // m
-    Vector3f topLeft = imageCenter + (this->right * this->imgPlane.left) + (this->up * this->imgPlane.top); // q
     float i = (this->imgPlane.right - this->imgPlane.left) * (col + 0.5) / this->imgPlane.nx; // s_u
     float j = (this->imgPlane.top - this->imgPlane.bottom) * (row + 0.5) / this->imgPlane.ny; // s_v
 
-    Vector3f targetPoint = topLeft + (this->right * i) - (this->up * j); // s
+    Vector3f targetPoint = this->topLeft + (this->right * i) - (this->up * j); // s
     // We have to normalize the direction to the length of 1 so it doesn't skew our results
     Vector3f rayDirection = normalize(targetPoint - origin); // d = s - e
 
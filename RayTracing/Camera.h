@@ -33,11 +33,16 @@ public:
     // Computes the primary ray through pixel (row, col)
 	Ray getPrimaryRay(int row, int col) const;
 
+    // Whether the camera can be rendered: a named image of a sane size on a finite, non-empty plane in front of it
+    bool isValid() const;
+
 private:
     Vector3f pos;
     Vector3f gaze;
     Vector3f up;
     Vector3f right;
+    Vector3f imageCenter;   // m, center of the image plane
+    Vector3f topLeft;       // q, top left corner of the image plane
 };
 
 #endif
@@ -11,6 +11,15 @@ Image::Image(int width, int height)
     }
 }
 
+Image::~Image()
+{
+    for (int y = 0; y < height; ++y)
+    {
+        delete [] data[y];
+    }
+    delete [] data;
+}
+
 //
 // Set the value of the pixel at the given column and row
 //
@@ -20,11 +29,13 @@ void Image::setPixelValue(int col, int row, const Color& color)
 }
 
 /* Takes the image name as a file and saves it as a ppm file. */
-void Image::saveImage(const char *imageName) const
+bool Image::saveImage(const char *imageName) const
 {
 	FILE *output;
 
 	output = fopen(imageName, "w");
+	if (!output)
+		return false;
 	fprintf(output, "P3\n");
 	fprintf(output, "%d %d\n", width, height);
 	fprintf(output, "255\n");
@@ -42,5 +53,5 @@ void Image::saveImage(const char *imageName) const
 		fprintf(output, "\n");
 	}
 
-	fclose(output);
+	return fclose(output) == 0;
 }
@@ -31,8 +31,11 @@ public:
 	int height;						// Image height
 
 	Image(int width, int height);	// Constructor
+	~Image();
+	Image(const Image &) = delete;	// Owns its rows
+	Image & operator=(const Image &) = delete;
 	void setPixelValue(int col, int row, const Color& color); // Sets the value of the pixel at the given column and row
-	void saveImage(const char *imageName) const;	          // Takes the image name as a file and saves it as a ppm file. 
+	bool saveImage(const char *imageName) const;	          // Takes the image name as a file and saves it as a ppm file, false if it cannot be written
 };
 
 #endif
@@ -23,3 +23,7 @@ Vector3f PointLight::computeLightContribution(const Vector3f& p) {
     Vector3f irradianceContribution = this->intensity / (lightDistance * lightDistance);
     return irradianceContribution;
 }
+
+const Vector3f & PointLight::getIntensity() const {
+    return this->intensity;
+}
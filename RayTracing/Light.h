@@ -13,6 +13,7 @@ public:
 
     PointLight(const Vector3f & position, const Vector3f & intensity);	// Constructor
     Vector3f computeLightContribution(const Vector3f& p); // Compute the contribution of light at point p
+    const Vector3f & getIntensity() const;
 
 private:
 
@@ -0,0 +1,94 @@
+#include "LightTree.h"
+#include "helpers.h"
+#include <algorithm>
+
+// Leaves never hold more lights than this
+const int maxLightsPerLeaf = 4;
+
+static inline float axisValue(const Vector3f & v, int axis)
+{
+    return (&v.x)[axis];
+}
+
+LightTree::LightTree(const vector<PointLight *> & lights)
+{
+    for (int i = 0; i < (int) lights.size(); ++i) {
+        Vector3f intensity = lights[i]->getIntensity();
+        positions.push_back(lights[i]->position);
+        intensities.push_back(max(intensity.r, max(intensity.g, intensity.b)));
+        lightIndices.push_back(i);
+    }
+    if (lights.empty())
+        return;
+
+    // A binary tree over n lights never has more than 2n - 1 nodes
+    nodes.reserve(2 * lights.size() - 1);
+    nodes.resize(1);
+    build(0, 0, lights.size());
+}
+
+// Builds the subtree rooted at nodeIndex over lightIndices[begin, end), splitting at the median of the widest axis
+void LightTree::build(int nodeIndex, int begin, int end)
+{
+    Node node;
+    node.maxIntensity = 0.0f;
+    for (int i = begin; i < end; ++i) {
+        node.bounds.grow(positions[lightIndices[i]]);
+        node.maxIntensity = max(node.maxIntensity, intensities[lightIndices[i]]);
+    }
+
+    if (end - begin <= maxLightsPerLeaf) {
+        node.offset = begin;
+        node.count = end - begin;
+        nodes[nodeIndex] = node;
+        return;
+    }
+
+    Vector3f extent = node.bounds.max - node.bounds.min;
+    int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+    int middle = begin + (end - begin) / 2;
+    nth_element(lightIndices.begin() + begin, lightIndices.begin() + middle, lightIndices.begin() + end,
+            [this, axis](int a, int b) { return axisValue(positions[a], axis) < axisValue(positions[b], axis); });
+
+    node.offset = nodes.size();
+    node.count = 0;
+    nodes[nodeIndex] = node;
+    nodes.resize(nodes.size() + 2);
+    build(node.offset, begin, middle);
+    build(node.offset + 1, middle, end);
+}
+
+void LightTree::selectLights(const Vector3f & point, float cutoff, vector<int> & selected) const
+{
+    selected.clear();
+    if (nodes.empty())
+        return;
+
+    int stack[64];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize > 0) {
+        const Node & node = nodes[stack[--stackSize]];
+
+        // Nearest point of the box to the point, no light of the node is closer
+        Vector3f nearest = {min(max(point.x, node.bounds.min.x), node.bounds.max.x),
+                            min(max(point.y, node.bounds.min.y), node.bounds.max.y),
+                            min(max(point.z, node.bounds.min.z), node.bounds.max.z)};
+        Vector3f offset = nearest - point;
+        float squaredDistance = dotProduct(offset, offset);
+        if (node.maxIntensity < cutoff * squaredDistance)
+            continue;
+
+        if (node.count == 0) {
+            stack[stackSize++] = node.offset;
+            stack[stackSize++] = node.offset + 1;
+            continue;
+        }
+        for (int i = node.offset; i < node.offset + node.count; ++i) {
+            int light = lightIndices[i];
+            Vector3f lightDirection = positions[light] - point;
+            if (intensities[light] >= cutoff * dotProduct(lightDirection, lightDirection))
+                selected.push_back(light);
+        }
+    }
+}
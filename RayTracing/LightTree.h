@@ -0,0 +1,41 @@
+#ifndef _LIGHTTREE_H_
+#define _LIGHTTREE_H_
+
+#include <vector>
+#include "Light.h"
+#include "defs.h"
+
+using namespace std;
+
+/* Binary tree over the point lights of a scene, used to find the lights that are bright enough at a point without
+looking at every light. Each node keeps the box of its lights' positions and the largest intensity channel among
+them, which bounds the irradiance any of them gives at a point by that intensity over the squared distance to the
+box. Subtrees whose bound is below the cutoff are skipped at once, so with many lights spread over a scene only the
+nearby or bright ones are visited. */
+class LightTree
+{
+public:
+    LightTree(const vector<PointLight *> & lights);
+
+    /* Writes to selected the indices of the lights whose irradiance at the point, in its largest channel, is at
+    least cutoff. They come in the order of the tree, which is the same for every point. */
+    void selectLights(const Vector3f & point, float cutoff, vector<int> & selected) const;
+
+private:
+    typedef struct Node
+    {
+        AABB bounds;
+        float maxIntensity;
+        int offset;     // Interior: index of the left child, the right child follows it. Leaf: index of the first light
+        int count;      // Number of lights in the leaf, 0 for interior nodes
+    } Node;
+
+    vector<Node> nodes;         // Root is the first node
+    vector<int> lightIndices;   // Ordered so that every leaf references a contiguous range
+    vector<Vector3f> positions; // [light]
+    vector<float> intensities;  // Largest channel of the intensity, [light]
+
+    void build(int nodeIndex, int begin, int end);
+};
+
+#endif
@@ -13,6 +13,7 @@ public:
 	Vector3f diffuseRef;	// Coefficients for diffuse reflection
 	Vector3f specularRef;	// Coefficients for specular reflection
 	Vector3f mirrorRef;		// Coefficients for mirror reflection
+	int shadingKernel = 0;	// Shading kernel specialized for the traits of the material, bound by the scene before rendering
 
 	Material(void);	// Constructor
 	
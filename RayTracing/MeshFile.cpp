@@ -0,0 +1,429 @@
+#include "MeshFile.h"
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Vertices are copied in bulk as arrays of x, y, z floats
+static_assert(sizeof(Vector3f) == 3 * sizeof(float), "Vector3f is three packed floats");
+
+static bool fail(const char * path, const char * message)
+{
+    fprintf(stderr, "%s: %s\n", path, message);
+    return false;
+}
+
+static inline bool isBlank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+// Converts the token at cursor, a number up to the next blank or '/', and moves past it
+template <typename T>
+static bool convertToken(const char *& cursor, const char * end, T & value)
+{
+    while (cursor != end && isBlank(*cursor))
+        cursor++;
+    if (cursor != end && *cursor == '+')
+        cursor++;
+    from_chars_result result = from_chars(cursor, end, value);
+    if (result.ec != errc() || result.ptr == cursor)
+        return false;
+    cursor = result.ptr;
+    return cursor == end || isBlank(*cursor) || *cursor == '\n' || *cursor == '/';
+}
+
+/* Appends the triangles of a polygon of the file, as a fan around its first vertex. Indices are 0 based in the file,
+vertexBase is the scene index of the first vertex of the file. */
+template <typename Index>
+static bool addPolygon(const Index * polygon, int size, int64_t vertexCount, int vertexBase, int matIndex,
+        vector<Triangle> & faces)
+{
+    if (size < 3)
+        return false;
+    for (int i = 0; i < size; ++i) {
+        if (polygon[i] < 0 || polygon[i] >= vertexCount)
+            return false;
+    }
+    for (int i = 2; i < size; ++i) {
+        faces.push_back(Triangle(-1, matIndex, vertexBase + polygon[0], vertexBase + polygon[i - 1],
+                vertexBase + polygon[i]));
+    }
+    return true;
+}
+
+bool MeshFile::load(const char * path, int matIndex, vector<Vector3f> & vertices, vector<Triangle> & faces)
+{
+    int descriptor = open(path, O_RDONLY);
+    if (descriptor < 0)
+        return fail(path, "cannot open the mesh file");
+    struct stat status;
+    void * mapping = MAP_FAILED;
+    if (fstat(descriptor, &status) == 0 && status.st_size > 0)
+        mapping = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    close(descriptor);
+    if (mapping == MAP_FAILED)
+        return fail(path, "cannot map the mesh file, or it is empty");
+    madvise(mapping, status.st_size, MADV_SEQUENTIAL);
+
+    const char * begin = static_cast<const char *>(mapping);
+    const char * end = begin + status.st_size;
+    size_t vertexCount = vertices.size();
+    size_t faceCount = faces.size();
+    bool loaded;
+    if (end - begin >= 4 && memcmp(begin, "ply", 3) == 0 && (begin[3] == '\n' || begin[3] == '\r'))
+        loaded = loadPLY(path, begin, end, matIndex, vertices, faces);
+    else
+        loaded = loadOBJ(path, begin, end, matIndex, vertices, faces);
+    munmap(mapping, status.st_size);
+
+    if (!loaded) {
+        vertices.erase(vertices.begin() + vertexCount, vertices.end());
+        faces.erase(faces.begin() + faceCount, faces.end());
+    }
+    return loaded;
+}
+
+/* Reads the v and f lines of an OBJ file, one line at a time, every other line is ignored. Face corners may be
+written v, v/vt, v//vn or v/vt/vn, only v is used, and negative indices count back from the last vertex. */
+bool MeshFile::loadOBJ(const char * path, const char * begin, const char * end, int matIndex,
+        vector<Vector3f> & vertices, vector<Triangle> & faces)
+{
+    int vertexBase = vertices.size() + 1;
+    int64_t vertexCount = 0;
+    vector<int64_t> polygon;
+    int lineNumber = 0;
+    for (const char * line = begin; line < end; ) {
+        const char * lineEnd = static_cast<const char *>(memchr(line, '\n', end - line));
+        if (!lineEnd)
+            lineEnd = end;
+        lineNumber++;
+        const char * cursor = line;
+        line = lineEnd + 1;
+        while (cursor != lineEnd && isBlank(*cursor))
+            cursor++;
+        if (lineEnd - cursor < 2 || !isBlank(cursor[1]))
+            continue;
+
+        bool valid = true;
+        if (cursor[0] == 'v') {
+            // Coordinates go through double as atof does, a w or a color after them is ignored
+            double coordinates[3] = {0.0, 0.0, 0.0};
+            cursor++;
+            for (int axis = 0; axis < 3 && valid; ++axis)
+                valid = convertToken(cursor, lineEnd, coordinates[axis]);
+            vertices.push_back({(float) coordinates[0], (float) coordinates[1], (float) coordinates[2]});
+            vertexCount++;
+        }
+        else if (cursor[0] == 'f') {
+            polygon.clear();
+            cursor++;
+            while (valid) {
+                while (cursor != lineEnd && isBlank(*cursor))
+                    cursor++;
+                if (cursor == lineEnd)
+                    break;
+                int64_t index;
+                valid = convertToken(cursor, lineEnd, index) && index != 0;
+                polygon.push_back(index > 0 ? index - 1 : vertexCount + index);
+                // Texture coordinate and normal indices
+                while (cursor != lineEnd && !isBlank(*cursor))
+                    cursor++;
+            }
+            valid = valid && addPolygon(polygon.data(), polygon.size(), vertexCount, vertexBase, matIndex, faces);
+        }
+        if (!valid) {
+            string message = "invalid OBJ line " + to_string(lineNumber);
+            return fail(path, message.c_str());
+        }
+    }
+    return true;
+}
+
+int MeshFile::getTypeSize(PlyType type)
+{
+    static const int sizes[] = {1, 1, 2, 2, 4, 4, 4, 8};
+    return sizes[type];
+}
+
+// Reads the values of a PLY body one by one, each checked against the end of the file
+class MeshFile::PlyReader
+{
+public:
+    const char * cursor;
+    const char * end;
+
+    PlyReader(const char * begin, const char * end, PlyFormat format)
+        : cursor(begin), end(end), format(format)
+    {
+        bool littleEndian = __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__;
+        swapBytes = format == (littleEndian ? BinaryBigEndian : BinaryLittleEndian);
+    }
+
+    // Whether the values are stored just as in memory, so that they can be copied without conversion
+    bool isNative() const {
+        return format != Ascii && !swapBytes;
+    }
+
+    bool read(PlyType type, double & value) {
+        if (format == Ascii) {
+            while (cursor != end && (isBlank(*cursor) || *cursor == '\n'))
+                cursor++;
+            if (type == Float32 || type == Float64)
+                return convertToken(cursor, end, value);
+            int64_t integer;
+            if (!convertToken(cursor, end, integer))
+                return false;
+            value = integer;
+            return true;
+        }
+
+        int size = getTypeSize(type);
+        if (end - cursor < size)
+            return false;
+        unsigned char bytes[8];
+        memcpy(bytes, cursor, size);
+        cursor += size;
+        for (int i = 0; swapBytes && i < size / 2; ++i) {
+            unsigned char byte = bytes[i];
+            bytes[i] = bytes[size - 1 - i];
+            bytes[size - 1 - i] = byte;
+        }
+        switch (type) {
+            case Int8: value = get<int8_t>(bytes); break;
+            case UInt8: value = get<uint8_t>(bytes); break;
+            case Int16: value = get<int16_t>(bytes); break;
+            case UInt16: value = get<uint16_t>(bytes); break;
+            case Int32: value = get<int32_t>(bytes); break;
+            case UInt32: value = get<uint32_t>(bytes); break;
+            case Float32: value = get<float>(bytes); break;
+            case Float64: value = get<double>(bytes); break;
+        }
+        return true;
+    }
+
+    // Reads a row of an element, the values of its list property items go to list
+    bool readRow(const PlyElement & element, double * values, vector<int64_t> * list, int listProperty) {
+        for (int p = 0; p < (int) element.properties.size(); ++p) {
+            const PlyProperty & property = element.properties[p];
+            if (!property.isList) {
+                if (!read(property.type, values[p]))
+                    return false;
+                continue;
+            }
+            // Every item takes at least a byte, so a larger count cannot be read and is not cast to an integer
+            double count;
+            if (!read(property.countType, count) || !(count >= 0 && count <= end - cursor))
+                return false;
+            if (p == listProperty)
+                list->clear();
+            for (int64_t i = 0; i < (int64_t) count; ++i) {
+                double item;
+                if (!read(property.type, item))
+                    return false;
+                if (p == listProperty) {
+                    if (!(fabs(item) < 0x1p62))     // A float index too large for an integer, or not a number
+                        return false;
+                    list->push_back((int64_t) item);
+                }
+            }
+        }
+        return true;
+    }
+
+private:
+    PlyFormat format;
+    bool swapBytes;     // The file's byte order is not the machine's
+
+    template <typename T>
+    static T get(const unsigned char * bytes) {
+        T value;
+        memcpy(&value, bytes, sizeof(T));
+        return value;
+    }
+};
+
+bool MeshFile::parsePlyHeader(const char *& cursor, const char * end, PlyFormat & format, vector<PlyElement> & elements)
+{
+    static const char * typeNames[][2] = {{"char", "int8"}, {"uchar", "uint8"}, {"short", "int16"},
+            {"ushort", "uint16"}, {"int", "int32"}, {"uint", "uint32"}, {"float", "float32"}, {"double", "float64"}};
+    auto parseType = [&](const string & name, PlyType & type) {
+        for (int t = 0; t < 8; ++t) {
+            if (name == typeNames[t][0] || name == typeNames[t][1]) {
+                type = (PlyType) t;
+                return true;
+            }
+        }
+        return false;
+    };
+
+    bool hasFormat = false;
+    while (cursor < end) {
+        const char * lineEnd = static_cast<const char *>(memchr(cursor, '\n', end - cursor));
+        if (!lineEnd)
+            return false;
+        istringstream line(string(cursor, lineEnd));
+        cursor = lineEnd + 1;
+        string keyword;
+        line >> keyword;
+        if (keyword == "end_header")
+            return hasFormat;
+        if (keyword == "format") {
+            string name;
+            line >> name;
+            if (name == "ascii")
+                format = Ascii;
+            else if (name == "binary_little_endian")
+                format = BinaryLittleEndian;
+            else if (name == "binary_big_endian")
+                format = BinaryBigEndian;
+            else
+                return false;
+            hasFormat = true;
+        }
+        else if (keyword == "element") {
+            PlyElement element;
+            if (!(line >> element.name >> element.count))
+                return false;
+            elements.push_back(element);
+        }
+        else if (keyword == "property") {
+            if (elements.empty())
+                return false;
+            PlyProperty property;
+            string type;
+            line >> type;
+            property.isList = type == "list";
+            property.countType = UInt8;
+            if (property.isList) {
+                string countType;
+                line >> countType >> type;
+                if (!parseType(countType, property.countType) || property.countType == Float32 ||
+                        property.countType == Float64)
+                    return false;
+            }
+            if (!parseType(type, property.type) || !(line >> property.name))
+                return false;
+            elements.back().properties.push_back(property);
+        }
+        else if (keyword != "ply" && keyword != "comment" && keyword != "obj_info" && !keyword.empty())
+            return false;
+    }
+    return false;
+}
+
+/* Reads the vertex and face elements of a PLY file, other elements are skipped. Faces are read from their
+vertex_indices list. When the file is binary in the byte order of the machine, vertices made of float x, y, z only
+are copied in one block, and triangles whose face element is just a uchar count and int indices are copied
+three indices at a time. */
+bool MeshFile::loadPLY(const char * path, const char * begin, const char * end, int matIndex,
+        vector<Vector3f> & vertices, vector<Triangle> & faces)
+{
+    const char * cursor = begin;
+    PlyFormat format;
+    vector<PlyElement> elements;
+    if (!parsePlyHeader(cursor, end, format, elements))
+        return fail(path, "invalid PLY header");
+
+    PlyReader reader(cursor, end, format);
+    int vertexBase = vertices.size() + 1;
+    int64_t vertexCount = 0;
+    vector<int64_t> polygon;
+    for (const PlyElement & element : elements) {
+        int xyz[3] = {-1, -1, -1};
+        int indices = -1;
+        for (int p = 0; p < (int) element.properties.size(); ++p) {
+            const PlyProperty & property = element.properties[p];
+            for (int axis = 0; axis < 3; ++axis) {
+                if (!property.isList && property.name == string(1, 'x' + axis))
+                    xyz[axis] = p;
+            }
+            if (property.isList && (property.name == "vertex_indices" || property.name == "vertex_index"))
+                indices = p;
+        }
+        bool isVertex = element.name == "vertex";
+        bool isFace = element.name == "face";
+        if (isVertex && (xyz[0] < 0 || xyz[1] < 0 || xyz[2] < 0))
+            return fail(path, "PLY vertices have no x, y, z properties");
+        if (isFace && indices < 0)
+            return fail(path, "PLY faces have no vertex_indices property");
+        if (element.count > (size_t) (end - reader.cursor))
+            return fail(path, "PLY element count is larger than the file");
+
+        // Rows of scalars only have the same size in binary files
+        int rowSize = 0;
+        int offsets[3] = {0, 0, 0};
+        bool floatXYZ = true;
+        for (int p = 0; p < (int) element.properties.size(); ++p) {
+            const PlyProperty & property = element.properties[p];
+            for (int axis = 0; axis < 3; ++axis) {
+                if (p == xyz[axis]) {
+                    offsets[axis] = rowSize;
+                    floatXYZ = floatXYZ && property.type == Float32;
+                }
+            }
+            rowSize = property.isList ? -1 : rowSize + getTypeSize(property.type);
+            if (rowSize < 0)
+                break;
+        }
+
+        if (isVertex && reader.isNative() && rowSize > 0 && floatXYZ && offsets[1] == offsets[0] + 4 &&
+                offsets[2] == offsets[0] + 8) {
+            if ((size_t) (end - reader.cursor) / rowSize < element.count)
+                return fail(path, "PLY file ends in its vertices");
+            size_t first = vertices.size();
+            vertices.resize(first + element.count);
+            if (rowSize == sizeof(Vector3f))
+                memcpy(&vertices[first], reader.cursor, element.count * sizeof(Vector3f));
+            else {
+                for (size_t i = 0; i < element.count; ++i)
+                    memcpy(&vertices[first + i], reader.cursor + i * rowSize + offsets[0], sizeof(Vector3f));
+            }
+            reader.cursor += element.count * rowSize;
+            vertexCount += element.count;
+            continue;
+        }
+
+        const PlyProperty * list = indices >= 0 ? &element.properties[indices] : nullptr;
+        if (isFace && reader.isNative() && element.properties.size() == 1 && list->countType == UInt8 &&
+                (list->type == Int32 || list->type == UInt32)) {
+            faces.reserve(faces.size() + element.count);
+            for (size_t i = 0; i < element.count; ++i) {
+                if (reader.cursor == end)
+                    return fail(path, "PLY file ends in its faces");
+                int size = (uint8_t) *reader.cursor++;
+                if (end - reader.cursor < size * 4)
+                    return fail(path, "PLY file ends in its faces");
+                // uint indices over 2^31 read as negative, they are out of range either way
+                int32_t corners[UINT8_MAX];
+                memcpy(corners, reader.cursor, size * 4);
+                reader.cursor += size * 4;
+                if (!addPolygon(corners, size, vertexCount, vertexBase, matIndex, faces))
+                    return fail(path, "invalid PLY face");
+            }
+            continue;
+        }
+
+        vector<double> values(element.properties.size());
+        if (isVertex)
+            vertices.reserve(vertices.size() + element.count);
+        for (size_t i = 0; i < element.count; ++i) {
+            if (!reader.readRow(element, values.data(), &polygon, isFace ? indices : -1))
+                return fail(path, "PLY file ends early or holds an invalid value");
+            if (isVertex) {
+                vertices.push_back({(float) values[xyz[0]], (float) values[xyz[1]], (float) values[xyz[2]]});
+                vertexCount++;
+            }
+            else if (isFace && !addPolygon(polygon.data(), polygon.size(), vertexCount, vertexBase, matIndex, faces))
+                return fail(path, "invalid PLY face");
+        }
+    }
+    return true;
+}
@@ -0,0 +1,70 @@
+#ifndef _MESHFILE_H_
+#define _MESHFILE_H_
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include "Shape.h"
+#include "defs.h"
+
+using namespace std;
+
+/* Reader for the external mesh files a scene refers to with <Mesh><File>path</File></Mesh>, in OBJ or PLY format.
+The file is mapped and read straight into the vertices and faces of the scene in one pass, without building any
+intermediate representation of it. Binary PLY files whose vertices are float x, y, z are copied in bulk.
+Polygons with more than three vertices are split into a fan of triangles. */
+class MeshFile
+{
+public:
+    /* Appends the vertices of the file at path to vertices and its faces, referring to them, to faces with matIndex.
+    Returns false with a message on stderr if the file cannot be read or is not a valid mesh, nothing is appended then. */
+    static bool load(const char * path, int matIndex, vector<Vector3f> & vertices, vector<Triangle> & faces);
+
+private:
+    enum PlyFormat
+    {
+        Ascii,
+        BinaryLittleEndian,
+        BinaryBigEndian
+    };
+
+    // Type of a PLY property, or of the count and items of a list property
+    enum PlyType
+    {
+        Int8,
+        UInt8,
+        Int16,
+        UInt16,
+        Int32,
+        UInt32,
+        Float32,
+        Float64
+    };
+
+    typedef struct PlyProperty
+    {
+        string name;
+        PlyType type;       // Type of the items for lists
+        bool isList;
+        PlyType countType;  // Lists only
+    } PlyProperty;
+
+    typedef struct PlyElement
+    {
+        string name;
+        size_t count;
+        vector<PlyProperty> properties;
+    } PlyElement;
+
+    // Reads the values of a PLY body, ASCII or binary
+    class PlyReader;
+
+    static bool loadOBJ(const char * path, const char * begin, const char * end, int matIndex,
+            vector<Vector3f> & vertices, vector<Triangle> & faces);
+    static bool loadPLY(const char * path, const char * begin, const char * end, int matIndex,
+            vector<Vector3f> & vertices, vector<Triangle> & faces);
+    static bool parsePlyHeader(const char *& cursor, const char * end, PlyFormat & format, vector<PlyElement> & elements);
+    static int getTypeSize(PlyType type);
+};
+
+#endif
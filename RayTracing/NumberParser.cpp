@@ -0,0 +1,125 @@
+#include "NumberParser.h"
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <thread>
+
+static inline bool isSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+/* Converts the token at cursor and moves past it. Returns false if it is not a number of type T, value is then 0.
+A leading '+' is accepted as atof and atoi do. */
+template <typename T>
+static bool convertToken(const char *& cursor, const char * end, T & value)
+{
+    while (cursor != end && isSpace(*cursor))
+        cursor++;
+    const char * token = cursor;
+    while (cursor != end && !isSpace(*cursor))
+        cursor++;
+    if (token != cursor && *token == '+')
+        token++;
+    from_chars_result result = from_chars(token, cursor, value);
+    if (result.ec != errc() || result.ptr != cursor) {
+        value = 0;
+        return false;
+    }
+    return true;
+}
+
+bool NumberParser::forEachChunk(int chunkCount, const function<bool(int)> & parse)
+{
+    vector<char> valid(chunkCount);
+    vector<thread> threads;
+    for (int i = 1; i < chunkCount; ++i)
+        threads.push_back(thread([&, i] { valid[i] = parse(i); }));
+    valid[0] = parse(0);
+    for (thread & t : threads)
+        t.join();
+    return count(valid.begin(), valid.end(), 0) == 0;
+}
+
+vector<NumberParser::Chunk> NumberParser::split(const char * text, size_t & tokenCount)
+{
+    size_t length = text ? strlen(text) : 0;
+    int chunkCount = max<size_t>(1, min<size_t>(thread::hardware_concurrency(), length / parallelLength));
+
+    // Every cut is moved forward to the next whitespace so that no token is split
+    vector<Chunk> chunks(chunkCount);
+    const char * begin = text;
+    for (int i = 0; i < chunkCount; ++i) {
+        const char * end = text + length * (i + 1) / chunkCount;
+        while (end < text + length && !isSpace(*end))
+            end++;
+        chunks[i] = {begin, max(begin, end), 0, 0};
+        begin = chunks[i].end;
+    }
+
+    forEachChunk(chunkCount, [&](int i) {
+        Chunk & chunk = chunks[i];
+        bool inToken = false;
+        for (const char * c = chunk.begin; c != chunk.end; ++c) {
+            bool space = isSpace(*c);
+            chunk.tokenCount += !inToken && !space;
+            inToken = !space;
+        }
+        return true;
+    });
+    tokenCount = 0;
+    for (Chunk & chunk : chunks) {
+        chunk.firstToken = tokenCount;
+        tokenCount += chunk.tokenCount;
+    }
+    return chunks;
+}
+
+bool NumberParser::parseVertices(const char * text, vector<Vector3f> & vertices)
+{
+    size_t tokenCount;
+    vector<Chunk> chunks = split(text, tokenCount);
+    size_t first = vertices.size();
+    size_t coordinateCount = tokenCount - tokenCount % 3;
+    vertices.resize(first + tokenCount / 3);
+
+    bool valid = forEachChunk(chunks.size(), [&](int i) {
+        const Chunk & chunk = chunks[i];
+        const char * cursor = chunk.begin;
+        bool numbers = true;
+        size_t last = min(chunk.firstToken + chunk.tokenCount, coordinateCount);
+        for (size_t token = chunk.firstToken; token < last; ++token) {
+            // Rounded to double then to float, as atof does
+            double coordinate;
+            numbers &= convertToken(cursor, chunk.end, coordinate);
+            (&vertices[first + token / 3].x)[token % 3] = (float) coordinate;
+        }
+        return numbers;
+    });
+    return valid && coordinateCount == tokenCount;
+}
+
+bool NumberParser::parseFaces(const char * text, int vertexOffset, int matIndex, vector<Triangle> & faces)
+{
+    size_t tokenCount;
+    vector<Chunk> chunks = split(text, tokenCount);
+    size_t indexCount = tokenCount - tokenCount % 3;
+    vector<int> indices(indexCount);
+
+    bool valid = forEachChunk(chunks.size(), [&](int i) {
+        const Chunk & chunk = chunks[i];
+        const char * cursor = chunk.begin;
+        bool numbers = true;
+        size_t last = min(chunk.firstToken + chunk.tokenCount, indexCount);
+        for (size_t token = chunk.firstToken; token < last; ++token) {
+            numbers &= convertToken(cursor, chunk.end, indices[token]);
+            indices[token] += vertexOffset;
+        }
+        return numbers;
+    });
+
+    faces.reserve(faces.size() + indexCount / 3);
+    for (size_t i = 0; i < indexCount; i += 3)
+        faces.push_back(Triangle(-1, matIndex, indices[i], indices[i + 1], indices[i + 2]));
+    return valid && indexCount == tokenCount;
+}
@@ -0,0 +1,44 @@
+#ifndef _NUMBERPARSER_H_
+#define _NUMBERPARSER_H_
+
+#include <cstddef>
+#include <functional>
+#include <vector>
+#include "Shape.h"
+#include "defs.h"
+
+using namespace std;
+
+/* Parser for the long whitespace separated lists of numbers of scene files: VertexData and the Faces of meshes.
+The tokens of a list are counted first so that its points or faces are allocated once, then converted in place with
+from_chars. Lists longer than parallelLength characters are cut at whitespace into chunks parsed on their own
+threads, each chunk knowing from the counts where its values go. */
+class NumberParser
+{
+public:
+    /* Appends the points of a list of coordinates, three per point, converted the same way atof does. Returns false
+    if a token is not a number, which then reads as 0, or if the count is not a multiple of three, the incomplete
+    point being left out. */
+    static bool parseVertices(const char * text, vector<Vector3f> & vertices);
+
+    /* Appends the faces of a list of vertex indices, three per face, each shifted by vertexOffset. Faces are given
+    matIndex and no id. Fails like parseVertices. */
+    static bool parseFaces(const char * text, int vertexOffset, int matIndex, vector<Triangle> & faces);
+
+    static const size_t parallelLength = 1 << 18;  // About a millisecond of parsing, well above the cost of a thread
+
+private:
+    // Part of a list cut at whitespace, and where its tokens are in the whole list
+    typedef struct Chunk
+    {
+        const char * begin;
+        const char * end;
+        size_t firstToken;
+        size_t tokenCount;
+    } Chunk;
+
+    static vector<Chunk> split(const char * text, size_t & tokenCount);  // Cuts text into chunks and counts their tokens
+    static bool forEachChunk(int chunkCount, const function<bool(int)> & parse);  // True if parse was true for every chunk
+};
+
+#endif
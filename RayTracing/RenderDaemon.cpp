@@ -0,0 +1,164 @@
+#include "RenderDaemon.h"
+#include "Camera.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <sstream>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static double millisecondsSince(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+RenderDaemon::RenderDaemon(int cacheSize, const function<Scene *(const char *)> & loadScene)
+    : cache(cacheSize, loadScene)
+{
+}
+
+bool RenderDaemon::serve(FILE * in, FILE * out)
+{
+    char * line = nullptr;
+    size_t capacity = 0;
+    bool running = true;
+    while (running && getline(&line, &capacity, in) != -1)
+        running = handle(line, out);
+    free(line);
+    return running;
+}
+
+int RenderDaemon::serveSocket(const char * path)
+{
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return 1;
+    }
+    strcpy(address.sun_path, path);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);   // Left behind by a daemon that did not stop cleanly
+    if (listener < 0 || bind(listener, (sockaddr *) &address, sizeof(address)) != 0 || listen(listener, 16) != 0) {
+        perror("Cannot listen on the socket");
+        return 1;
+    }
+    // A client leaving before its answer must not stop the daemon
+    signal(SIGPIPE, SIG_IGN);
+
+    bool running = true;
+    int status = 0;
+    while (running) {
+        int connection = accept(listener, nullptr, nullptr);
+        if (connection < 0) {
+            // A signal or a client leaving before it was accepted, the next one can be accepted right away
+            int error = errno;
+            if (error == EINTR || error == ECONNABORTED)
+                continue;
+            // Out of descriptors or memory for now, retried once the requests in flight elsewhere had time to end
+            perror("Cannot accept a connection");
+            if (error == EMFILE || error == ENFILE || error == ENOBUFS || error == ENOMEM) {
+                sleep(1);
+                continue;
+            }
+            status = 1;
+            break;
+        }
+        FILE * in = fdopen(connection, "r");
+        FILE * out = fdopen(dup(connection), "w");
+        running = serve(in, out);
+        fclose(out);
+        fclose(in);
+    }
+
+    close(listener);
+    unlink(path);
+    return status;
+}
+
+// Answers a single request, returns false for "quit"
+bool RenderDaemon::handle(const string & request, FILE * out)
+{
+    istringstream tokens(request);
+    string token, scenePath, output;
+    vector<int> cameraIds;
+    bool allCameras = true;
+    while (tokens >> token) {
+        if (token.compare(0, 10, "--cameras=") == 0) {
+            allCameras = false;
+            istringstream ids(token.substr(10));
+            string id;
+            // An id listed twice still renders its camera once
+            while (getline(ids, id, ',')) {
+                int cameraId = atoi(id.c_str());
+                if (find(cameraIds.begin(), cameraIds.end(), cameraId) == cameraIds.end())
+                    cameraIds.push_back(cameraId);
+            }
+        }
+        else if (token.compare(0, 9, "--output=") == 0)
+            output = token.substr(9);
+        else if (scenePath.empty() && token[0] != '-')
+            scenePath = token;
+        else {
+            fprintf(out, "error unknown argument %s\n", token.c_str());
+            fflush(out);
+            return true;
+        }
+    }
+    if (scenePath.empty())      // Blank line
+        return true;
+    if (scenePath == "quit")
+        return false;
+
+    auto start = chrono::steady_clock::now();
+    bool cached;
+    Scene * scene = cache.get(scenePath, cached);
+    double setupTime = millisecondsSince(start);
+    if (!scene) {
+        // The cache only loads regular files, one that exists failed to parse
+        struct stat status;
+        bool exists = stat(scenePath.c_str(), &status) == 0 && S_ISREG(status.st_mode);
+        fprintf(out, "error cannot %s %s\n", exists ? "parse" : "read", scenePath.c_str());
+        fflush(out);
+        return true;
+    }
+
+    // Every id asked for has to name a camera of the scene
+    auto missing = find_if(cameraIds.begin(), cameraIds.end(), [scene](int id) {
+        return none_of(scene->cameras.begin(), scene->cameras.end(), [id](const Camera * c) { return c->id == id; });
+    });
+    vector<int> cameras;
+    for (int x = 0; x < (int) scene->cameras.size(); ++x) {
+        if (allCameras || find(cameraIds.begin(), cameraIds.end(), scene->cameras[x]->id) != cameraIds.end())
+            cameras.push_back(x);
+    }
+    bool toDirectory = !output.empty() && output.back() == '/';
+    if (missing != cameraIds.end())
+        fprintf(out, "error no camera with id %d in %s\n", *missing, scenePath.c_str());
+    else if (!output.empty() && !toDirectory && cameras.size() != 1)
+        fprintf(out, "error --output names a single image but %d cameras are rendered\n", (int) cameras.size());
+    else {
+        start = chrono::steady_clock::now();
+        atomic<bool> saved(true);
+        renderer.render(*scene, cameras, [&](int camera, Image & image) {
+            const char * imageName = scene->cameras[camera]->imageName;
+            string path = output.empty() ? imageName : toDirectory ? output + imageName : output;
+            if (!image.saveImage(path.c_str()))
+                saved = false;
+        });
+        if (saved)
+            fprintf(out, "ok %s setup=%.3fms render=%.3fms\n", cached ? "cached" : "parsed", setupTime,
+                    millisecondsSince(start));
+        else
+            fprintf(out, "error cannot write the images of %s\n", scenePath.c_str());
+    }
+    fflush(out);
+    return true;
+}
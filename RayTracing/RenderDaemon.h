@@ -0,0 +1,35 @@
+#ifndef _RENDERDAEMON_H_
+#define _RENDERDAEMON_H_
+
+#include <cstdio>
+#include <functional>
+#include <string>
+#include "Renderer.h"
+#include "SceneCache.h"
+
+using namespace std;
+
+/* Long running renderer serving requests, one per line, so that repeated jobs on a scene skip parsing it and building
+its BVH, which are kept in a SceneCache. A request is
+
+    scene.xml [--cameras=ID,ID,...] [--output=PATH]
+
+and renders the cameras with the given ids, all of them by default. Images are saved under the name the scene gives
+them, or into PATH when it ends with '/', or to PATH itself when a single camera is rendered. Each request is answered
+with one line, "ok parsed|cached setup=MS render=MS" or "error MESSAGE". "quit" stops the daemon. */
+class RenderDaemon
+{
+public:
+    RenderDaemon(int cacheSize, const function<Scene *(const char *)> & loadScene);
+
+    bool serve(FILE * in, FILE * out);  // Serves the requests read from in until its end, false once "quit" is read
+    int serveSocket(const char * path); // Serves the connections made to a Unix socket at path, one at a time, until "quit"
+
+private:
+    SceneCache cache;
+    Renderer renderer;
+
+    bool handle(const string & request, FILE * out);
+};
+
+#endif
@@ -0,0 +1,749 @@
+#include "Renderer.h"
+#include "Scene.h"
+#include "Camera.h"
+#include "Light.h"
+#include "Material.h"
+#include "LightTree.h"
+#include "TileScheduler.h"
+#include "helpers.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+#include <thread>
+
+const float INF = numeric_limits<float>::max();
+const int wavefrontPacketSize = 8; // Sorted reflected rays traced together
+
+
+IntersectionData intersectRay(const Ray & ray, const Scene * scene) {
+
+    /* Calculate the nearest intersection point by traversing the scene's BVH with given ray,
+     * only the shapes whose bounding boxes are pierced by the ray are tested */
+
+    return scene->bvh->intersect(ray);
+}
+
+// Primitive that last blocked a shadow ray towards each light on this thread, -1 for none, reset by execute
+static thread_local vector<int> lastOccluders;
+static thread_local ShadowStats threadShadowStats;
+
+bool occludedRay(const Ray & ray, float tMax, int light, const Scene * scene) {
+
+    /* Check whether anything blocks the ray before tMax, traversal stops at the first such shape.
+     * Shadow rays of neighbouring points towards a light are mostly blocked by the same shape, so the one that
+     * blocked the last shadow ray towards this light is tested first, and the traversal skipped if it blocks again */
+
+    ++threadShadowStats.rays;
+    if (!scene->occluderCache) {
+        bool occluded = scene->bvh->occluded(ray, tMax);
+        threadShadowStats.occluded += occluded;
+        return occluded;
+    }
+
+    int & occluder = lastOccluders[light];
+    if (occluder >= 0) {
+        ++threadShadowStats.cacheTests;
+        if (scene->bvh->occludedBy(ray, tMax, occluder)) {
+            ++threadShadowStats.cacheHits;
+            ++threadShadowStats.occluded;
+            return true;
+        }
+    }
+    // Lit points mostly have lit neighbours, so a ray that is not blocked clears the occluder to save the test
+    bool occluded = scene->bvh->occluded(ray, tMax, occluder);
+    if (!occluded)
+        occluder = -1;
+    threadShadowStats.occluded += occluded;
+    return occluded;
+}
+
+Vector3f computeSpecular(const Material * material, const Vector3f & normalVector,
+        const Vector3f & irradiance, const Vector3f & halfVector) {
+    // (cosAlpha)^ns
+    float phongExponentCosAlpha = pow(max(0.0f, dotProduct(normalVector, halfVector)), material->phongExp);
+    // (cosAlpha)^ns * E(d)
+    Vector3f specular = irradiance * phongExponentCosAlpha;
+    // Multiplying with specular coeff
+    specular.r *= material->specularRef.r;
+    specular.g *= material->specularRef.g;
+    specular.b *= material->specularRef.b;
+
+    return specular;
+}
+
+Vector3f computeDiffuse(const Material * material, const Vector3f & normalVector,
+        const Vector3f & normalizedLightDirection, const Vector3f & irradiance) {
+
+    // cosTheta
+    float cosTheta = max(0.0f, dotProduct(normalizedLightDirection, normalVector));
+    // cosTheta * E(d)
+    Vector3f diffuse = irradiance * cosTheta;
+    // Multiplying with kd
+    diffuse.r *= material->diffuseRef.r;
+    diffuse.g *= material->diffuseRef.g;
+    diffuse.b *= material->diffuseRef.b;
+
+    return diffuse;
+}
+
+Vector3f computeAmbient(const Material * material, const Vector3f & ambientLight) {
+    return {material->ambientRef.r * ambientLight.r,
+            material->ambientRef.g * ambientLight.g,
+            material->ambientRef.b * ambientLight.b};
+}
+
+// Cast the shadow ray s from intersection point to the light, starting a bit further to avoid fp precision errors
+Ray getShadowRay(const Vector3f & intersectionPoint, const Vector3f & normalizedLightDirection, const Scene * scene) {
+    Ray shadowRay;
+    Vector3f intOffset = normalizedLightDirection * scene->shadowRayEps; // moving intPoint a bit further to avoid fp precision errors
+    shadowRay.origin = intersectionPoint + intOffset;
+    shadowRay.direction = normalizedLightDirection;
+    return shadowRay;
+}
+
+/* Shading is done by kernels specialized at compile time for the traits of a material, so that no work is spent on
+ * terms that are zero for it. Every material is bound to the kernel matching its traits when the scene is parsed (see
+ * Scene::bindShadingKernels). The kernels skip only terms that add exactly zero or replace a power of zero by one,
+ * so they give the same colors as the general computation. */
+enum SpecularKind
+{
+    NoSpecular,         // specularRef is zero, there is no highlight
+    ConstantSpecular,   // phongExp is zero, (cosAlpha)^0 is one and the half vector is not needed
+    PhongSpecular
+};
+
+/* Calculate diffuse and specular shading from a light source that is not blocked and add them to the pixelColor */
+template <SpecularKind specular>
+void addLightContribution(Vector3f & pixelColor, const Material * intersectionMaterial, const Vector3f & normal,
+        const Vector3f & intersectionPoint, const Vector3f & normalizedEyeVector,
+        const Vector3f & normalizedLightDirection, PointLight * light) {
+
+    // Compute irradiance of light source i on intersection point
+    Vector3f irradiance = light->computeLightContribution(intersectionPoint);
+
+    // Compute Diffuse
+    Vector3f diffuseContribution = computeDiffuse(intersectionMaterial, normal, normalizedLightDirection, irradiance);
+    pixelColor += diffuseContribution;
+
+    // Compute Specular
+    if (specular == ConstantSpecular) {
+        pixelColor += {irradiance.r * intersectionMaterial->specularRef.r,
+                       irradiance.g * intersectionMaterial->specularRef.g,
+                       irradiance.b * intersectionMaterial->specularRef.b};
+    }
+    else if (specular == PhongSpecular) {
+        Vector3f normalizedHalfVector = normalize(normalizedLightDirection + normalizedEyeVector);
+        Vector3f specularContribution = computeSpecular(intersectionMaterial, normal, irradiance, normalizedHalfVector);
+        pixelColor += specularContribution;
+    }
+}
+
+bool isMirror(const Material * material) {
+    return material->mirrorRef.x > 0 || material->mirrorRef.y > 0 || material->mirrorRef.z > 0;
+}
+
+Ray getReflectedRay(const Vector3f & normal, const Vector3f & intersectionPoint, const Vector3f & normalizedEyeVector,
+        const Scene * scene) {
+
+    // Calculate reflected ray's direction using w_r = -w_0 + 2*n*cosTheta => cosTheta = n.w_0
+    // Also move set its origin as intersectionPoint which is moved a bit further by shadowRayEps
+    Ray reflectedRay;
+    float cosTheta = dotProduct(normal, normalizedEyeVector); // w_0.n
+    reflectedRay.direction = (normalizedEyeVector * -1) + (normal * (2 * cosTheta)); // -w_0 + 2n.cosTheta
+    reflectedRay.origin = intersectionPoint + (reflectedRay.direction * scene->shadowRayEps);
+    return reflectedRay;
+}
+
+// Adds the radiance coming from a mirror reflection, attenuated by the mirror reflectance of the material
+void addReflectedRadiance(Vector3f & pixelColor, const Material * intersectionMaterial, Vector3f reflectedRadiance) {
+    reflectedRadiance.x *= intersectionMaterial->mirrorRef.x;
+    reflectedRadiance.y *= intersectionMaterial->mirrorRef.y;
+    reflectedRadiance.z *= intersectionMaterial->mirrorRef.z;
+    pixelColor += reflectedRadiance;
+}
+
+// Dont forget to clamp the resulting pixelColor
+Vector3f clampColor(Vector3f pixelColor) {
+    pixelColor.r = min(max(0.0f, pixelColor.r), 255.0f);
+    pixelColor.g = min(max(0.0f, pixelColor.g), 255.0f);
+    pixelColor.b = min(max(0.0f, pixelColor.b), 255.0f);
+    return pixelColor;
+}
+
+/* Throughput of the reflection at a hit: the weight of the reflected radiance in the pixel, given the throughput of
+ * the hit. It is the product of the mirror reflectances along the path, except that a channel the hit's own color
+ * already saturates stays at 255 no matter what is added to it, so its throughput is zero. */
+Vector3f getReflectedThroughput(const Vector3f & throughput, const Material * material, const Vector3f & localColor) {
+    return {localColor.r < 255.0f ? throughput.r * material->mirrorRef.r : 0.0f,
+            localColor.g < 255.0f ? throughput.g * material->mirrorRef.g : 0.0f,
+            localColor.b < 255.0f ? throughput.b * material->mirrorRef.b : 0.0f};
+}
+
+/* Whether a reflection can still change the pixel. Reflected radiance is clamped to 255 and the clamps above it
+ * only shrink its effect, so it changes the pixel by at most 255 times its largest throughput channel. Reflections
+ * below scene->minContribution output levels are not traced, nor are the ones whose throughput is zero. Skipped
+ * contributions add up before the pixel is truncated, so only a minContribution of 0 keeps the image exact. */
+bool isReflectionVisible(const Vector3f & throughput, const Scene * scene) {
+    float maxThroughput = max(throughput.r, max(throughput.g, throughput.b));
+    return maxThroughput > 0.0f && maxThroughput * 255.0f >= scene->minContribution;
+}
+
+/* Writes to selected the indices of the lights a point is shaded with. With a positive lightCutoff the light tree
+ * leaves out the lights whose irradiance at the point is below it, before any shadow ray is cast towards them,
+ * otherwise every light is used in the order of the scene. */
+void selectShadingLights(const Vector3f & point, const Scene * scene, vector<int> & selected) {
+    if (scene->lightCutoff > 0.0f)
+        scene->lightTree->selectLights(point, scene->lightCutoff, selected);
+    else {
+        selected.resize(scene->lights.size());
+        iota(selected.begin(), selected.end(), 0);
+    }
+}
+
+// Ambient shading and the diffuse and specular shading of the lights that are not blocked, before any reflection
+template <SpecularKind specular>
+Vector3f computeLocalRadiance(const Ray & ray, const IntersectionData & intersection, const Material * intersectionMaterial,
+        const Scene * scene, Vector3f & intersectionPoint, Vector3f & normalizedEyeVector) {
+
+    Vector3f pixelColor = {};
+
+    // Calculate Ambient shading and add it to pixelColor (adding ambient directly to all pixels)
+    Vector3f ambientContribution = computeAmbient(intersectionMaterial, scene->ambientLight);
+    pixelColor = ambientContribution;
+
+    intersectionPoint = ray.origin + (ray.direction * intersection.t);
+    // subtract intPoint from camera's position (origin) and find the vector that goes to eye
+    Vector3f eyeVector = ray.origin - intersectionPoint; // w_0
+    normalizedEyeVector = normalize(eyeVector);
+
+    // For each light i bright enough to matter
+    static thread_local vector<int> shadingLights;
+    selectShadingLights(intersectionPoint, scene, shadingLights);
+    for (int i : shadingLights) {
+
+        Vector3f lightDirection = scene->lights[i]->position - intersectionPoint; // w_i
+        Vector3f normalizedLightDirection = normalize(lightDirection);
+        Ray shadowRay = getShadowRay(intersectionPoint, normalizedLightDirection, scene);
+
+        // Check whether there is any obj between the light source and point, any such obj will do
+        if (!occludedRay(shadowRay, vectorLength(lightDirection), i, scene)) {
+            // If there is not an intersection between the light source and point
+            // Then there is contribution from this light source -- point is not in shadow
+            addLightContribution<specular>(pixelColor, intersectionMaterial, intersection.normal, intersectionPoint,
+                    normalizedEyeVector, normalizedLightDirection, scene->lights[i]);
+        }
+        // Else there is an intersection -- point is in shadow -- no contribution from this light
+    }
+
+    return pixelColor;
+}
+
+// Local radiance of a hit along a chain of mirror reflections, and the material weighting what comes after it
+typedef struct Bounce
+{
+    Vector3f color;
+    const Material * material;
+} Bounce;
+
+/* Shades a hit of the reflection chain followed by computeRadiance: pushes its local radiance on the stack and, for
+ * mirrors whose reflection can still change the pixel, sets the reflected ray and its throughput. Returns whether
+ * the reflection is to be followed. */
+template <SpecularKind specular, bool hasMirror>
+bool shadeBounce(const Ray & ray, const IntersectionData & intersection, const Scene * scene, int depth,
+        vector<Bounce> & stack, Vector3f & throughput, Ray & reflectedRay) {
+
+    const Material * intersectionMaterial = scene->materials[intersection.materialId - 1];
+    Vector3f intersectionPoint, normalizedEyeVector;
+    Vector3f pixelColor = computeLocalRadiance<specular>(ray, intersection, intersectionMaterial, scene,
+            intersectionPoint, normalizedEyeVector);
+    stack.push_back({pixelColor, intersectionMaterial});
+
+    // Bounce the ray until no intersection, maxRecDepth or nothing visible left to gain
+    if (!hasMirror || depth >= scene->maxRecursionDepth)
+        return false;
+    throughput = getReflectedThroughput(throughput, intersectionMaterial, pixelColor);
+    if (!isReflectionVisible(throughput, scene))
+        return false;
+
+    reflectedRay = getReflectedRay(intersection.normal, intersectionPoint, normalizedEyeVector, scene);
+    return true;
+}
+
+// Adds the contributions of the lights[0, count) marked visible, lights[j] uses the direction of shadowRays[j]
+template <SpecularKind specular>
+void addLightContributions(Vector3f & pixelColor, const Material * intersectionMaterial, const Vector3f & normal,
+        const Vector3f & intersectionPoint, const Vector3f & normalizedEyeVector, const int * lights, int count,
+        const Ray * shadowRays, const char * visible, const Scene * scene) {
+    for (int j = 0; j < count; ++j) {
+        if (visible[j])
+            addLightContribution<specular>(pixelColor, intersectionMaterial, normal, intersectionPoint,
+                    normalizedEyeVector, shadowRays[j].direction, scene->lights[lights[j]]);
+    }
+}
+
+// Kernels of one combination of material traits
+typedef struct ShadingKernel
+{
+    bool (*shadeBounce)(const Ray &, const IntersectionData &, const Scene *, int, vector<Bounce> &, Vector3f &, Ray &);
+    void (*addLightContributions)(Vector3f &, const Material *, const Vector3f &, const Vector3f &,
+            const Vector3f &, const int *, int, const Ray *, const char *, const Scene *);
+    bool hasMirror;
+} ShadingKernel;
+
+#define SHADING_KERNEL(specular, hasMirror) \
+    {shadeBounce<specular, hasMirror>, addLightContributions<specular>, hasMirror}
+
+// Indexed by Material::shadingKernel, which is 2 * SpecularKind + hasMirror
+const ShadingKernel shadingKernels[] = {
+    SHADING_KERNEL(NoSpecular, false), SHADING_KERNEL(NoSpecular, true),
+    SHADING_KERNEL(ConstantSpecular, false), SHADING_KERNEL(ConstantSpecular, true),
+    SHADING_KERNEL(PhongSpecular, false), SHADING_KERNEL(PhongSpecular, true)
+};
+
+int Renderer::getShadingKernel(const Material * material)
+{
+    bool hasSpecular = material->specularRef.r != 0 || material->specularRef.g != 0 || material->specularRef.b != 0;
+    SpecularKind specular = !hasSpecular ? NoSpecular : material->phongExp == 0 ? ConstantSpecular : PhongSpecular;
+    return 2 * specular + isMirror(material);
+}
+
+/* Radiance along the ray, following mirror reflections iteratively: the local radiance of every hit is pushed on a
+ * stack while the reflections are traced, until a ray misses, maxRecursionDepth reflections are made or the next
+ * reflection cannot visibly change the pixel. The stack is then folded from the last hit up, each hit adding the
+ * clamped radiance of the next one weighted by its mirror reflectance. */
+Vector3f computeRadiance(const Ray & primRay, const IntersectionData & primIntersection, const Scene * scene) {
+
+    static thread_local vector<Bounce> stack;
+    stack.clear();
+
+    Ray ray = primRay;
+    IntersectionData intersection = primIntersection;
+    Vector3f throughput = {1.0f, 1.0f, 1.0f};
+    for (int depth = 0; ; ++depth) {
+        const ShadingKernel & kernel = shadingKernels[scene->materials[intersection.materialId - 1]->shadingKernel];
+        Ray reflectedRay;
+        if (!kernel.shadeBounce(ray, intersection, scene, depth, stack, throughput, reflectedRay))
+            break;
+
+        // Again Calculate the nearest intersection of reflected Ray
+        IntersectionData reflectedIntersection = intersectRay(reflectedRay, scene);
+        if (reflectedIntersection.t == INF) // no intersection, nothing is reflected
+            break;
+
+        ray = reflectedRay;
+        intersection = reflectedIntersection;
+    }
+
+    Vector3f radiance = clampColor(stack.back().color);
+    for (int depth = stack.size() - 2; depth >= 0; --depth) {
+        Vector3f pixelColor = stack[depth].color;
+        addReflectedRadiance(pixelColor, stack[depth].material, radiance);
+        radiance = clampColor(pixelColor);
+    }
+    return radiance;
+}
+
+Color shadePixel(const Ray & primRay, const IntersectionData & intersection, const Scene * scene) {
+
+    if (intersection.t != INF) { // means that ray hit an object
+        Vector3f pxColor = computeRadiance(primRay, intersection, scene);
+        return {static_cast<unsigned char>(pxColor.r),
+                static_cast<unsigned char>(pxColor.g),
+                static_cast<unsigned char>(pxColor.b)};
+    }
+    else { // no intersection, just set the pixel's color to background color
+        return {static_cast<unsigned char>(scene->backgroundColor.r),
+                static_cast<unsigned char>(scene->backgroundColor.g),
+                static_cast<unsigned char>(scene->backgroundColor.b)};
+    }
+}
+
+Color renderPixel(int col, int row, const Scene * scene, int camIndex) {
+
+    // Calculate primary ray from Camera x that goes through pixel
+    Ray primRay = scene->cameras[camIndex]->getPrimaryRay(row, col);
+
+    // Calculate nearest intersection
+    IntersectionData intersection = intersectRay(primRay, scene);
+
+    return shadePixel(primRay, intersection, scene);
+}
+
+void renderTile(Image * image, const Tile & tile, const Scene * scene, int camIndex) {
+    // For each pixel in given Tile
+    for (int row = tile.firstRow; row < tile.endRow; ++row) {
+        for (int col = tile.firstCol; col < tile.endCol; ++col) {
+            Color colorOfPixel = renderPixel(col, row, scene, camIndex);
+            image->setPixelValue(col, row, colorOfPixel);
+        }
+    }
+}
+
+/* Renders the tile in square blocks of packetSize x packetSize pixels. The primary rays of a block are
+ * traced through the BVH as one packet, then each pixel is shaded on its own. */
+void renderPacketTile(Image * image, const Tile & tile, const Scene * scene, int camIndex) {
+    const Camera * camera = scene->cameras[camIndex];
+    int size = scene->packetSize;
+    Ray rays[BVH::maxPacketSize];
+    IntersectionData intersections[BVH::maxPacketSize];
+
+    for (int firstRow = tile.firstRow; firstRow < tile.endRow; firstRow += size) {
+        int endRow = min(firstRow + size, tile.endRow);
+        for (int firstCol = tile.firstCol; firstCol < tile.endCol; firstCol += size) {
+            int endCol = min(firstCol + size, tile.endCol);
+            int count = 0;
+            for (int row = firstRow; row < endRow; ++row)
+                for (int col = firstCol; col < endCol; ++col)
+                    rays[count++] = camera->getPrimaryRay(row, col);
+
+            scene->bvh->intersectPacket(rays, count, intersections);
+
+            count = 0;
+            for (int row = firstRow; row < endRow; ++row) {
+                for (int col = firstCol; col < endCol; ++col) {
+                    image->setPixelValue(col, row, shadePixel(rays[count], intersections[count], scene));
+                    ++count;
+                }
+            }
+        }
+    }
+}
+
+/* Wavefront rendering: instead of following every pixel's rays depth first, the rays of a whole tile
+ * go through the stages together. Primary rays are generated and intersected, then each level of hits is shaded
+ * by emitting all of its shadow rays, testing them, and emitting all of its reflected rays, whose hits make the
+ * next level. Reflected rays are sorted so that similar rays are traced together (see coherentOrder).
+ * Every color is computed with the same operations in the same order as computeRadiance, so both renderers
+ * produce the same image. */
+
+// Hit of a ray waiting to be shaded by the wavefront renderer
+typedef struct PathVertex
+{
+    Ray ray;
+    IntersectionData intersection;
+    Vector3f intersectionPoint;
+    Vector3f normalizedEyeVector;
+    Vector3f color;     // Ambient and direct light, then the reflected radiance once the next level is shaded
+    Vector3f throughput; // Weight of the vertex's radiance in the pixel, see getReflectedThroughput
+    int parent;         // Vertex of the previous level whose reflected ray this is, pixel index for primary rays
+} PathVertex;
+
+// Spreads the bits of v, clamped to 10 bits, so that two zero bits follow each of them
+static inline uint64_t expandBits(float value) {
+    uint64_t v = (uint64_t) min(max(value, 0.0f), 1023.0f);
+    v = (v | (v << 16)) & 0x30000ff;
+    v = (v | (v << 8)) & 0x300f00f;
+    v = (v | (v << 4)) & 0x30c30c3;
+    v = (v | (v << 2)) & 0x9249249;
+    return v;
+}
+
+/* Order in which to trace the rays so that consecutive rays visit similar parts of the BVH: rays are sorted by the
+ * octant of their direction, then by their direction on a coarse grid, then by the Morton code of their origin
+ * within the box of all origins. */
+vector<int> coherentOrder(const vector<Ray> & rays) {
+    AABB originBounds;
+    for (const Ray & ray : rays)
+        originBounds.grow(ray.origin);
+    Vector3f extent = originBounds.max - originBounds.min;
+    Vector3f scale = {extent.x > 0 ? 1023 / extent.x : 0, extent.y > 0 ? 1023 / extent.y : 0,
+                      extent.z > 0 ? 1023 / extent.z : 0};
+
+    vector<pair<uint64_t, int>> keys(rays.size());
+    for (int i = 0; i < (int) rays.size(); ++i) {
+        const Vector3f & d = rays[i].direction;
+        Vector3f o = rays[i].origin - originBounds.min;
+        uint64_t octant = (d.x < 0) | (d.y < 0) << 1 | (d.z < 0) << 2;
+        uint64_t direction = expandBits(min(fabs(d.x), 1.0f) * 31) | expandBits(min(fabs(d.y), 1.0f) * 31) << 1 |
+                             expandBits(min(fabs(d.z), 1.0f) * 31) << 2;
+        uint64_t origin = expandBits(o.x * scale.x) | expandBits(o.y * scale.y) << 1 | expandBits(o.z * scale.z) << 2;
+        keys[i] = {octant << 60 | direction << 30 | origin, i};
+    }
+    sort(keys.begin(), keys.end());
+
+    vector<int> order(rays.size());
+    for (int i = 0; i < (int) rays.size(); ++i)
+        order[i] = keys[i].second;
+    return order;
+}
+
+void renderWavefrontTile(Image * image, const Tile & tile, const Scene * scene, int camIndex) {
+    const Camera * camera = scene->cameras[camIndex];
+    int nx = camera->imgPlane.nx;
+    int numLights = scene->lights.size();
+
+    // Generate the primary rays block by block, so that packets are square blocks of pixels
+    int size = scene->packetSize;
+    vector<Ray> rays;
+    vector<int> pixels;
+    vector<int> blockStarts;
+    for (int blockRow = tile.firstRow; blockRow < tile.endRow; blockRow += size) {
+        for (int blockCol = tile.firstCol; blockCol < tile.endCol; blockCol += size) {
+            blockStarts.push_back(rays.size());
+            for (int row = blockRow; row < min(blockRow + size, tile.endRow); ++row) {
+                for (int col = blockCol; col < min(blockCol + size, tile.endCol); ++col) {
+                    rays.push_back(camera->getPrimaryRay(row, col));
+                    pixels.push_back(row * nx + col);
+                }
+            }
+        }
+    }
+    blockStarts.push_back(rays.size());
+
+    // Intersect the primary rays
+    vector<IntersectionData> intersections(rays.size());
+    for (int block = 0; block + 1 < (int) blockStarts.size(); ++block) {
+        int begin = blockStarts[block], count = blockStarts[block + 1] - begin;
+        if (size > 1)
+            scene->bvh->intersectPacket(&rays[begin], count, &intersections[begin]);
+        else
+            intersections[begin] = intersectRay(rays[begin], scene);
+    }
+
+    // One level per reflection plus the empty level that ends the loop, each level is appended once it is complete
+    vector<vector<PathVertex>> levels(1);
+    levels[0].reserve(rays.size());
+    for (int i = 0; i < (int) rays.size(); ++i) {
+        if (intersections[i].t != INF) // means that ray hit an object
+            levels[0].push_back({rays[i], intersections[i], {}, {}, {}, {1.0f, 1.0f, 1.0f}, pixels[i]});
+        else { // no intersection, just set the pixel's color to background color
+            image->setPixelValue(pixels[i] % nx, pixels[i] / nx,
+                    {static_cast<unsigned char>(scene->backgroundColor.r),
+                     static_cast<unsigned char>(scene->backgroundColor.g),
+                     static_cast<unsigned char>(scene->backgroundColor.b)});
+        }
+    }
+
+    for (int depth = 0; !levels[depth].empty(); ++depth) {
+        vector<PathVertex> & vertices = levels[depth];
+        int count = vertices.size();
+
+        // Ambient shading and shadow rays towards every light bright enough, those of vertex v are in
+        // [lightBegin[v], lightBegin[v + 1])
+        vector<int> lightBegin(count + 1);
+        vector<int> shadowLights;
+        vector<Ray> shadowRays;
+        vector<float> lightDistances;
+        vector<int> selected;
+        for (int v = 0; v < count; ++v) {
+            PathVertex & vertex = vertices[v];
+            Material * intersectionMaterial = scene->materials[vertex.intersection.materialId - 1];
+            vertex.color = computeAmbient(intersectionMaterial, scene->ambientLight);
+            vertex.intersectionPoint = vertex.ray.origin + (vertex.ray.direction * vertex.intersection.t);
+            vertex.normalizedEyeVector = normalize(vertex.ray.origin - vertex.intersectionPoint);
+            lightBegin[v] = shadowRays.size();
+            selectShadingLights(vertex.intersectionPoint, scene, selected);
+            for (int i : selected) {
+                Vector3f lightDirection = scene->lights[i]->position - vertex.intersectionPoint;
+                shadowLights.push_back(i);
+                shadowRays.push_back(getShadowRay(vertex.intersectionPoint, normalize(lightDirection), scene));
+                lightDistances.push_back(vectorLength(lightDirection));
+            }
+        }
+        lightBegin[count] = shadowRays.size();
+
+        /* Shadow tests, light by light: the shadow rays of a point light all end at it and the vertices are in
+         * pixel order, so once the rays are grouped by light (with a counting sort) consecutive rays are coherent */
+        vector<int> lightOffsets(numLights + 1, 0);
+        for (int light : shadowLights)
+            ++lightOffsets[light + 1];
+        partial_sum(lightOffsets.begin(), lightOffsets.end(), lightOffsets.begin());
+        vector<int> shadowOrder(shadowRays.size());
+        for (int k = 0; k < (int) shadowRays.size(); ++k)
+            shadowOrder[lightOffsets[shadowLights[k]]++] = k;
+        vector<char> visible(shadowRays.size());
+        for (int k : shadowOrder)
+            visible[k] = !occludedRay(shadowRays[k], lightDistances[k], shadowLights[k], scene);
+
+        // Diffuse and specular shading from the lights that are not blocked, in the order of the lights
+        for (int v = 0; v < count; ++v) {
+            PathVertex & vertex = vertices[v];
+            Material * intersectionMaterial = scene->materials[vertex.intersection.materialId - 1];
+            int first = lightBegin[v];
+            shadingKernels[intersectionMaterial->shadingKernel].addLightContributions(vertex.color,
+                    intersectionMaterial, vertex.intersection.normal, vertex.intersectionPoint,
+                    vertex.normalizedEyeVector, shadowLights.data() + first, lightBegin[v + 1] - first,
+                    shadowRays.data() + first, visible.data() + first, scene);
+        }
+
+        // Reflected rays of mirror materials, their hits make the next level. Appending it may move the levels, so
+        // vertices is not used past that point.
+        if (depth >= scene->maxRecursionDepth) {
+            levels.emplace_back();
+            continue;
+        }
+        vector<Ray> reflectedRays;
+        vector<Vector3f> throughputs;
+        vector<int> parents;
+        for (int v = 0; v < count; ++v) {
+            PathVertex & vertex = vertices[v];
+            Material * intersectionMaterial = scene->materials[vertex.intersection.materialId - 1];
+            if (!shadingKernels[intersectionMaterial->shadingKernel].hasMirror)
+                continue;
+            Vector3f throughput = getReflectedThroughput(vertex.throughput, intersectionMaterial, vertex.color);
+            if (isReflectionVisible(throughput, scene)) {
+                reflectedRays.push_back(getReflectedRay(vertex.intersection.normal, vertex.intersectionPoint,
+                        vertex.normalizedEyeVector, scene));
+                throughputs.push_back(throughput);
+                parents.push_back(v);
+            }
+        }
+        // Consecutive rays in coherent order are similar enough to be traced as packets
+        vector<int> order = coherentOrder(reflectedRays);
+        vector<Ray> sortedRays(reflectedRays.size());
+        for (int k = 0; k < (int) order.size(); ++k)
+            sortedRays[k] = reflectedRays[order[k]];
+        vector<IntersectionData> sortedIntersections(sortedRays.size());
+        for (int begin = 0; begin < (int) sortedRays.size(); begin += wavefrontPacketSize) {
+            int packetCount = min(wavefrontPacketSize, (int) sortedRays.size() - begin);
+            scene->bvh->intersectPacket(&sortedRays[begin], packetCount, &sortedIntersections[begin]);
+        }
+        vector<IntersectionData> reflectedIntersections(reflectedRays.size());
+        for (int k = 0; k < (int) order.size(); ++k)
+            reflectedIntersections[order[k]] = sortedIntersections[k];
+        vector<PathVertex> nextLevel;
+        nextLevel.reserve(reflectedRays.size());
+        for (int k = 0; k < (int) reflectedRays.size(); ++k) {
+            if (reflectedIntersections[k].t != INF)
+                nextLevel.push_back({reflectedRays[k], reflectedIntersections[k], {}, {}, {}, throughputs[k],
+                        parents[k]});
+        }
+        levels.push_back(move(nextLevel));
+    }
+
+    // Add the reflected radiance of every level to the level above it, deepest first
+    for (int depth = levels.size() - 1; depth > 0; --depth) {
+        for (const PathVertex & vertex : levels[depth]) {
+            PathVertex & parent = levels[depth - 1][vertex.parent];
+            addReflectedRadiance(parent.color, scene->materials[parent.intersection.materialId - 1],
+                    clampColor(vertex.color));
+        }
+    }
+
+    for (const PathVertex & vertex : levels[0]) {
+        Vector3f pxColor = clampColor(vertex.color);
+        image->setPixelValue(vertex.parent % nx, vertex.parent / nx,
+                {static_cast<unsigned char>(pxColor.r),
+                 static_cast<unsigned char>(pxColor.g),
+                 static_cast<unsigned char>(pxColor.b)});
+    }
+}
+
+// What the workers of a render share
+typedef struct RenderJob
+{
+    vector<RenderTarget> targets;               // Scene and camera of each image
+    vector<Image *> images;
+    vector<atomic<int>> remainingTiles;         // Tiles of each image not rendered yet
+    TileScheduler * scheduler;
+    const function<void(int, Image &)> * imageDone;
+    vector<ShadowStats> shadowStats;            // Counters of each worker
+} RenderJob;
+
+/* Renders tiles of any image of the job until none is left. The worker that renders the last tile of an image hands
+ * it to imageDone right away, while the other workers carry on with the remaining images. */
+void execute(RenderJob & job, int worker) {
+    const Scene * scene = nullptr;
+    threadShadowStats = ShadowStats();
+
+    Tile tile;
+    while (job.scheduler->next(worker, tile)) {
+        Image * image = job.images[tile.image];
+        int camIndex = job.targets[tile.image].camera;
+        // The occluders of one scene mean nothing in another
+        if (job.targets[tile.image].scene != scene) {
+            scene = job.targets[tile.image].scene;
+            lastOccluders.assign(scene->lights.size(), -1);
+        }
+        if (scene->renderMode == Scene::Wavefront)
+            renderWavefrontTile(image, tile, scene, camIndex);
+        else if (scene->packetSize > 1)
+            renderPacketTile(image, tile, scene, camIndex);
+        else
+            renderTile(image, tile, scene, camIndex);
+
+        // The decrement orders the pixels every worker wrote before the image is handed over
+        if (--job.remainingTiles[tile.image] == 0)
+            (*job.imageDone)(tile.image, *image);
+    }
+    job.shadowStats[worker] = threadShadowStats;
+}
+
+Renderer::Renderer(int numThreads) : pool(numThreads > 0 ? numThreads : max(thread::hardware_concurrency(), 1u))
+{
+}
+
+void Renderer::render(const Scene & scene, int cameraIndex, Image & image, ShadowStats * stats)
+{
+    renderTargets(vector<RenderTarget>(1, {&scene, cameraIndex}), vector<Image *>(1, &image), [](int, Image &) {},
+            stats);
+}
+
+void Renderer::render(const Scene & scene, const vector<int> & cameras, const function<void(int, Image &)> & imageDone,
+        ShadowStats * stats)
+{
+    vector<RenderTarget> targets;
+    for (int x : cameras)
+        targets.push_back({&scene, x});
+    render(targets, [&](int target, Image & image) { imageDone(cameras[target], image); }, stats);
+}
+
+void Renderer::render(const vector<RenderTarget> & targets, const function<void(int, Image &)> & imageDone,
+        ShadowStats * stats)
+{
+    vector<Image *> images;
+    for (const RenderTarget & target : targets) {
+        const Camera * camera = target.scene->cameras[target.camera];
+        images.push_back(new Image(camera->imgPlane.nx, camera->imgPlane.ny));
+    }
+    renderTargets(targets, images, imageDone, stats);
+    for (Image * image : images)
+        delete image;
+}
+
+void Renderer::renderAll(const Scene & scene, const function<void(int, Image &)> & imageDone, ShadowStats * stats)
+{
+    vector<int> cameras(scene.cameras.size());
+    iota(cameras.begin(), cameras.end(), 0);
+    render(scene, cameras, imageDone, stats);
+}
+
+/* Tiles of every image go into one scheduler, so no worker idles while there is any image left to render. Calls
+ * from other threads wait for the current one, the workers render a single job at a time. */
+void Renderer::renderTargets(const vector<RenderTarget> & targets, const vector<Image *> & images,
+        const function<void(int, Image &)> & imageDone, ShadowStats * stats)
+{
+    lock_guard<mutex> guard(renderMutex);
+
+    vector<pair<int, int>> imageSizes;
+    for (const Image * image : images)
+        imageSizes.push_back({image->width, image->height});
+    TileScheduler scheduler(imageSizes, pool.size());
+
+    RenderJob job;
+    job.targets = targets;
+    job.images = images;
+    job.remainingTiles = vector<atomic<int>>(images.size());
+    job.scheduler = &scheduler;
+    job.imageDone = &imageDone;
+    job.shadowStats.resize(pool.size());
+    for (int i = 0; i < (int) images.size(); ++i) {
+        job.remainingTiles[i] = scheduler.getTileCount(i);
+        if (job.remainingTiles[i] == 0) // empty image, nothing to wait for
+            imageDone(i, *images[i]);
+    }
+
+    pool.run([&job](int worker) { execute(job, worker); });
+
+    if (stats) {
+        *stats = ShadowStats();
+        for (const ShadowStats & workerStats : job.shadowStats) {
+            stats->rays += workerStats.rays;
+            stats->occluded += workerStats.occluded;
+            stats->cacheTests += workerStats.cacheTests;
+            stats->cacheHits += workerStats.cacheHits;
+        }
+    }
+}
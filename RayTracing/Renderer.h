@@ -0,0 +1,55 @@
+#ifndef _RENDERER_H_
+#define _RENDERER_H_
+
+#include <functional>
+#include <mutex>
+#include <vector>
+#include "Image.h"
+#include "ThreadPool.h"
+#include "defs.h"
+
+using namespace std;
+
+class Material;
+
+// Image to render: a camera of a scene
+typedef struct RenderTarget
+{
+    const Scene * scene;
+    int camera;     // Index in the scene's cameras
+} RenderTarget;
+
+/* Ray tracer of parsed scenes. A render reads nothing but the scene and the image it is given, so one process can
+render any number of scenes, several at the same time when each is given its own Renderer. A Renderer owns its
+worker threads and renders one call at a time, calls made meanwhile from other threads wait for it. */
+class Renderer
+{
+public:
+    explicit Renderer(int numThreads = 0);  // 0 starts one worker per hardware thread
+
+    // Renders the scene from camera cameraIndex into image, which has the size of the camera's image plane. The
+    // scene's BVH must be built. The shadow ray counters of the render are written to stats if given.
+    void render(const Scene & scene, int cameraIndex, Image & image, ShadowStats * stats = nullptr);
+
+    // Renders the scene from each of the cameras, the tiles of all cameras share the workers. imageDone(camera, image)
+    // is called by a worker as soon as the image of a camera is complete, while the others carry on.
+    void render(const Scene & scene, const vector<int> & cameras, const function<void(int, Image &)> & imageDone,
+            ShadowStats * stats = nullptr);
+    // Same for every camera of the scene
+    void renderAll(const Scene & scene, const function<void(int, Image &)> & imageDone, ShadowStats * stats = nullptr);
+    // Same for targets of any number of scenes, whose tiles all share the workers. imageDone is given the index of the
+    // target in targets.
+    void render(const vector<RenderTarget> & targets, const function<void(int, Image &)> & imageDone,
+            ShadowStats * stats = nullptr);
+
+    static int getShadingKernel(const Material * material);  // Kernel specialized for the traits of the material, see Material::shadingKernel
+
+private:
+    ThreadPool pool;
+    mutex renderMutex;  // Held by the call being rendered
+
+    void renderTargets(const vector<RenderTarget> & targets, const vector<Image *> & images,
+            const function<void(int, Image &)> & imageDone, ShadowStats * stats);
+};
+
+#endif
@@ -4,204 +4,63 @@
 #include "Material.h"
 #include "Shape.h"
 #include "tinyxml2.h"
-#include "Image.h"
+#include "LightTree.h"
+#include "MeshFile.h"
+#include "NumberParser.h"
+#include "Renderer.h"
 #include "helpers.h"
-#include <limits>
-#include <thread>
-#include <mutex>
+#include <cstdarg>
+#include <unordered_map>
 
 using namespace tinyxml2;
-const float INF = numeric_limits<float>::max();
-int lastRow;
-mutex rowMutex;
 
-
-IntersectionData intersectRay(const Ray & ray, const vector<Shape *> & objects) {
-
-    /* Calculate the nearest intersection point calling Shape's intersect with given ray */
-
-    IntersectionData minIntersection = {INF, {}, -1};
-    // For each object in the scene Intersect ray with all the shapes in scene and get the nearest one
-    for (auto object : objects) {
-        IntersectionData tempIntersection = object->intersect(ray); // calling object's own intersect method
-        if (tempIntersection.t != INF) {
-            if (minIntersection.t > tempIntersection.t) {
-                minIntersection = tempIntersection;
-            }
-        }
-    }
-    return minIntersection;
-}
-
-Vector3f computeSpecular(const Material * material, const Vector3f & normalVector,
-        const Vector3f & irradiance, const Vector3f & halfVector) {
-    // (cosAlpha)^ns
-    float phongExponentCosAlpha = pow(max(0.0f, dotProduct(normalVector, halfVector)), material->phongExp);
-    // (cosAlpha)^ns * E(d)
-    Vector3f specular = irradiance * phongExponentCosAlpha;
-    // Multiplying with specular coeff
-    specular.r *= material->specularRef.r;
-    specular.g *= material->specularRef.g;
-    specular.b *= material->specularRef.b;
-
-    return specular;
-}
-
-Vector3f computeDiffuse(const Material * material, const Vector3f & normalVector,
-        const Vector3f & normalizedLightDirection, const Vector3f & irradiance) {
-
-    // cosTheta
-    float cosTheta = max(0.0f, dotProduct(normalizedLightDirection, normalVector));
-    // cosTheta * E(d)
-    Vector3f diffuse = irradiance * cosTheta;
-    // Multiplying with kd
-    diffuse.r *= material->diffuseRef.r;
-    diffuse.g *= material->diffuseRef.g;
-    diffuse.b *= material->diffuseRef.b;
-
-    return diffuse;
-}
-
-Vector3f computeAmbient(const Material * material, const Vector3f & ambientLight) {
-    return {material->ambientRef.r * ambientLight.r,
-            material->ambientRef.g * ambientLight.g,
-            material->ambientRef.b * ambientLight.b};
-}
-
-Vector3f computeRadiance(const Ray & ray, const IntersectionData & intersection, Scene * scene, int remainingRecursion) {
-
-    Vector3f pixelColor = {};
-    Material * intersectionMaterial = scene->materials[intersection.materialId - 1];
-
-    // Calculate Ambient shading and add it to pixelColor (adding ambient directly to all pixels)
-    Vector3f ambientContribution = computeAmbient(intersectionMaterial, scene->ambientLight);
-    pixelColor = ambientContribution;
-
-    Vector3f intersectionPoint = ray.origin + (ray.direction * intersection.t);
-    // subtract intPoint from camera's position (origin) and find the vector that goes to eye
-    Vector3f eyeVector = ray.origin - intersectionPoint; // w_0
-    Vector3f normalizedEyeVector = normalize(eyeVector);
-
-    // For each light i
-    for (int i = 0; i < scene->lights.size(); ++i) {
-
-        Vector3f lightDirection = scene->lights[i]->position - intersectionPoint; // w_i
-        Vector3f normalizedLightDirection = normalize(lightDirection);
-
-        // Cast the shadow ray s from intersection point to i
-        Ray shadowRay;
-        Vector3f intOffset = normalizedLightDirection * scene->shadowRayEps; // moving intPoint a bit further to avoid fp precision errors
-        shadowRay.origin = intersectionPoint + intOffset;
-        shadowRay.direction = normalizedLightDirection;
-
-        // Intersect s with all objects again to check if there is any obj between the light source and point
-        IntersectionData shadowIntersection = intersectRay(shadowRay, scene->objects);
-        if (shadowIntersection.t >= vectorLength(lightDirection)) {
-            // If there is not an intersection between the light source and point
-            // Then there is contribution from this light source -- point is not in shadow
-
-            /* Calculate diffuse and specular shading from this light source and add them to the pixelColor */
-
-            // Compute irradiance of light source i on intersection point
-            Vector3f irradiance = scene->lights[i]->computeLightContribution(intersectionPoint);
-
-            // Compute Diffuse
-            Vector3f diffuseContribution = computeDiffuse(intersectionMaterial, intersection.normal,
-                                                          normalizedLightDirection, irradiance);
-            pixelColor += diffuseContribution;
-
-            // Compute Specular
-            Vector3f normalizedHalfVector = normalize(normalizedLightDirection + normalizedEyeVector);
-            Vector3f specularContribution = computeSpecular(intersectionMaterial, intersection.normal,
-                    irradiance, normalizedHalfVector);
-            pixelColor += specularContribution;
-        }
-        else {
-            // Else there is an intersection continue -- point is in shadow -- no contribution from this light
-            continue;
-        }
-    }
-
-    // Check if the material of intersected object has a nonzero MirrorReflectance value
-    // Then Bounce primary ray until no intersection or maxRecDepth (count is initially zero)
-
-    if ((intersectionMaterial->mirrorRef.x > 0 || intersectionMaterial->mirrorRef.y > 0 ||
-    intersectionMaterial->mirrorRef.z > 0) && remainingRecursion > 0) {
-
-        // Calculate reflected ray's direction using w_r = -w_0 + 2*n*cosTheta => cosTheta = n.w_0
-        // Also move set its origin as intersectionPoint which is moved a bit further by shadowRayEps
-        Ray reflectedRay;
-//        float cosTheta = dotProduct(intersection.normal, ray.direction);
-//        reflectedRay.direction = ((ray.direction * -1) + (intersection.normal * (2 * cosTheta))) * -1; // W_0 is eyeVector -- could have used it instead of ray.direction and multiplying with -1 at the end
-//        reflectedRay.origin = intersectionPoint + (reflectedRay.direction * scene->shadowRayEps);
-
-        float cosTheta = dotProduct(intersection.normal, normalizedEyeVector); // w_0.n
-        reflectedRay.direction = (normalizedEyeVector * -1) + (intersection.normal * (2 * cosTheta)); // -w_0 + 2n.cosTheta
-        reflectedRay.origin = intersectionPoint + (reflectedRay.direction * scene->shadowRayEps);
-
-        // Again Calculate the nearest intersection of reflected Ray
-        IntersectionData reflectedIntersection = intersectRay(reflectedRay, scene->objects);
-
-        if (reflectedIntersection.t != INF) { // means that ray hit an object
-            Vector3f reflectedRadiance = computeRadiance(reflectedRay, reflectedIntersection, scene,
-                    remainingRecursion-1);
-
-            reflectedRadiance.x *= intersectionMaterial->mirrorRef.x;
-            reflectedRadiance.y *= intersectionMaterial->mirrorRef.y;
-            reflectedRadiance.z *= intersectionMaterial->mirrorRef.z;
-            pixelColor += reflectedRadiance;
-        }
-    }
-
-    // Dont forget to clamp the resulting pixelColor
-    pixelColor.r = min(max(0.0f, pixelColor.r), 255.0f);
-    pixelColor.g = min(max(0.0f, pixelColor.g), 255.0f);
-    pixelColor.b = min(max(0.0f, pixelColor.b), 255.0f);
-    return pixelColor;
+// Builds the BVH once every shape is parsed
+void Scene::buildBVH(BVH::BuildMethod method)
+{
+    updateMeshes();
+    delete bvh;
+    bvh = new BVH(*this, method);
+    bvhMethod = method;
 }
 
-Color renderPixel(int col, int row, Scene * scene, int camIndex) {
-
-    // Calculate primary ray from Camera x that goes through pixel
-    Ray primRay = scene->cameras[camIndex]->getPrimaryRay(row, col);
-
-    // Calculate nearest intersection
-    IntersectionData intersection = intersectRay(primRay, scene->objects);
-
-    if (intersection.t != INF) { // means that ray hit an object
-        Vector3f pxColor = computeRadiance(primRay, intersection, scene, scene->maxRecursionDepth);
-        return {static_cast<unsigned char>(pxColor.r),
-                static_cast<unsigned char>(pxColor.g),
-                static_cast<unsigned char>(pxColor.b)};
-    }
-    else { // no intersection, just set the pixel's color to background color
-        return {static_cast<unsigned char>(scene->backgroundColor.r),
-                static_cast<unsigned char>(scene->backgroundColor.g),
-                static_cast<unsigned char>(scene->backgroundColor.b)};
+// Binds every material to the shading kernel specialized for its traits
+void Scene::bindShadingKernels()
+{
+    for (Material * material : materials) {
+        material->shadingKernel = Renderer::getShadingKernel(material);
     }
 }
 
-void renderRow(Image * image, const int row, Scene * scene, int camIndex) {
-    // For each pixel in given Row
-    for (int col = 0; col < scene->cameras[camIndex]->imgPlane.nx; ++col) {
-        Color colorOfPixel = renderPixel(col, row, scene, camIndex);
-        image->setPixelValue(col, row, colorOfPixel);
+// Brings the face records meshes use for brute force tests up to date with the vertices
+void Scene::updateMeshes()
+{
+    for (Shape * object : objects) {
+        Mesh * mesh = dynamic_cast<Mesh *>(object);
+        if (mesh)
+            mesh->updateFaces(*this);
     }
 }
 
-int getTask() {
-    lock_guard<mutex> guard(rowMutex);
-    --lastRow;
-    return lastRow;
-}
-
-void execute(Image * image, Scene * scene, int camIndex) {
-    while (true) {
-        int rowNum = getTask();
-        if (rowNum < 0)
-            break;
-        renderRow(image, rowNum, scene, camIndex);
+/*
+ * Replaces the vertex positions for the next frame of a deforming scene. Shapes keep referring to the same
+ * vertex indices so the BVH only needs its boxes refitted, which is much cheaper than building it again.
+ * Refitting loosens the tree as primitives move apart though, so once its SAH cost has degraded past
+ * rebuildThreshold the BVH is rebuilt from scratch, along with the trees of instanced meshes. Returns false, leaving
+ * the scene as it was, if the number of vertices differs. Must not be called while rendering.
+ */
+bool Scene::updateVertices(const vector<Vector3f> & newVertices)
+{
+    if (newVertices.size() != vertices.size()) {
+        fprintf(stderr, "updateVertices: %d vertices given for a scene of %d\n", (int) newVertices.size(),
+                (int) vertices.size());
+        return false;
     }
+    vertices = newVertices;
+    updateMeshes();
+    bvh->refit(*this);
+    if (bvh->getDegradation() > rebuildThreshold)
+        buildBVH(bvhMethod);
+    return true;
 }
 
 /*
@@ -222,47 +81,89 @@ void Scene::renderScene(void)
                 Compute rgb value of pixel i according to results and fill it in Image instance
          Call save image and save the image
      */
-    const unsigned int numOfCores = thread::hardware_concurrency();
-    for (int x = 0; x < cameras.size(); ++x) {
-        auto * image = new Image(cameras[x]->imgPlane.nx,cameras[x]->imgPlane.ny);
-        lastRow = cameras[x]->imgPlane.ny;
-        if (!numOfCores)
-            execute(image, this, x);
-        else {
-            auto * threads = new thread[numOfCores];
-            for (int i = 0; i < numOfCores; i++) {
-                threads[i] = thread(execute, image, this, x);
-            }
-            for (int i = 0; i < numOfCores; i++)
-                threads[i].join();
-            delete[] threads;
-        }
-        image->saveImage(cameras[x]->imageName);
+    // The workers are started once and kept for later calls
+    if (!renderer)
+        renderer = new Renderer();
+    renderer->renderAll(*this, [this](int camera, Image & image) { image.saveImage(cameras[camera]->imageName); },
+            &shadowStats);
+}
+
+// Prints what is wrong with a scene file, false for the parser to return
+static bool parseError(const char *xmlPath, const char *format, ...)
+{
+    va_list arguments;
+    va_start(arguments, format);
+    fprintf(stderr, "%s: ", xmlPath);
+    vfprintf(stderr, format, arguments);
+    fprintf(stderr, "\n");
+    va_end(arguments);
+    return false;
+}
+
+// Text of the child element of element with the given name, nullptr if it is missing or empty
+static const char * getChildText(const XMLElement *element, const char *name)
+{
+    const XMLElement *child = element->FirstChildElement(name);
+    return child ? child->GetText() : nullptr;
+}
+
+// Reads the three numbers of a child element, false if it is missing or holds fewer
+static bool readChildVector(const XMLElement *element, const char *name, Vector3f & value)
+{
+    const char *str = getChildText(element, name);
+    return str && sscanf(str, "%f %f %f", &value.x, &value.y, &value.z) == 3;
+}
+
+static bool readChildInt(const XMLElement *element, const char *name, int & value)
+{
+    const XMLElement *child = element->FirstChildElement(name);
+    return child && child->QueryIntText(&value) == XML_SUCCESS;
+}
+
+static bool readChildFloat(const XMLElement *element, const char *name, float & value)
+{
+    const XMLElement *child = element->FirstChildElement(name);
+    return child && child->QueryFloatText(&value) == XML_SUCCESS;
+}
+
+// Parses XML file, nullptr if it is not a scene this tracer can render
+Scene * Scene::parse(const char *xmlPath)
+{
+    Scene *scene = new Scene();
+    if (!scene->parseXML(xmlPath)) {
+        delete scene;
+        return nullptr;
     }
+    return scene;
 }
 
-// Parses XML file.
-Scene::Scene(const char *xmlPath)
+/*
+ * Fills the empty scene from an XML file. Every element the renderer relies on is checked, along with the indices
+ * shapes refer to materials and vertices by, so that a malformed file is reported instead of crashing whoever
+ * renders it later; the daemon keeps serving after one. False, with the reason on stderr, if the file is unusable.
+ */
+bool Scene::parseXML(const char *xmlPath)
 {
     const char *str;
     XMLDocument xmlDoc;
     XMLError eResult;
     XMLElement *pElement;
 
-    maxRecursionDepth = 1;
-    shadowRayEps = 0.001;
-
     eResult = xmlDoc.LoadFile(xmlPath);
+    if (eResult != XML_SUCCESS)
+        return parseError(xmlPath, "%s", xmlDoc.ErrorName());
 
-    XMLNode *pRoot = xmlDoc.FirstChild();
+    XMLElement *pRoot = xmlDoc.RootElement();
+    if (!pRoot)
+        return parseError(xmlPath, "no root element");
 
     pElement = pRoot->FirstChildElement("MaxRecursionDepth");
-    if(pElement != nullptr)
-        pElement->QueryIntText(&maxRecursionDepth);
+    if (pElement != nullptr && (pElement->QueryIntText(&maxRecursionDepth) != XML_SUCCESS ||
+            maxRecursionDepth < 0 || maxRecursionDepth > maxRecursionLimit))
+        return parseError(xmlPath, "MaxRecursionDepth is not a number of reflections from 0 to %d", maxRecursionLimit);
 
-    pElement = pRoot->FirstChildElement("BackgroundColor");
-    str = pElement->GetText();
-    sscanf(str, "%f %f %f", &backgroundColor.r, &backgroundColor.g, &backgroundColor.b);
+    if (!readChildVector(pRoot, "BackgroundColor", backgroundColor))
+        return parseError(xmlPath, "BackgroundColor is not an r g b color");
 
     pElement = pRoot->FirstChildElement("ShadowRayEpsilon");
     if(pElement != nullptr)
@@ -270,49 +171,45 @@ Scene::Scene(const char *xmlPath)
 
     pElement = pRoot->FirstChildElement("IntersectionTestEpsilon");
     if(pElement != nullptr)
-        eResult = pElement->QueryFloatText(&intTestEps);
+        pElement->QueryFloatText(&intTestEps);
 
     // Parse cameras
     pElement = pRoot->FirstChildElement("Cameras");
-    XMLElement *pCamera = pElement->FirstChildElement("Camera");
-    XMLElement *camElement;
+    XMLElement *pCamera = pElement ? pElement->FirstChildElement("Camera") : nullptr;
     while(pCamera != nullptr)
     {
         int id;
-        char imageName[64];
         Vector3f pos, gaze, up;
         ImagePlane imgPlane;
 
         eResult = pCamera->QueryIntAttribute("id", &id);
-        camElement = pCamera->FirstChildElement("Position");
-        str = camElement->GetText();
-        sscanf(str, "%f %f %f", &pos.x, &pos.y, &pos.z);
-        camElement = pCamera->FirstChildElement("Gaze");
-        str = camElement->GetText();
-        sscanf(str, "%f %f %f", &gaze.x, &gaze.y, &gaze.z);
-        camElement = pCamera->FirstChildElement("Up");
-        str = camElement->GetText();
-        sscanf(str, "%f %f %f", &up.x, &up.y, &up.z);
-        camElement = pCamera->FirstChildElement("NearPlane");
-        str = camElement->GetText();
-        sscanf(str, "%f %f %f %f", &imgPlane.left, &imgPlane.right, &imgPlane.bottom, &imgPlane.top);
-        camElement = pCamera->FirstChildElement("NearDistance");
-        eResult = camElement->QueryFloatText(&imgPlane.distance);
-        camElement = pCamera->FirstChildElement("ImageResolution");
-        str = camElement->GetText();
-        sscanf(str, "%d %d", &imgPlane.nx, &imgPlane.ny);
-        camElement = pCamera->FirstChildElement("ImageName");
-        str = camElement->GetText();
-        strcpy(imageName, str);
-
-        cameras.push_back(new Camera(id, imageName, pos, gaze, up, imgPlane));
+        if (eResult != XML_SUCCESS)
+            return parseError(xmlPath, "a camera has no id");
+        str = getChildText(pCamera, "NearPlane");
+        bool planeRead = str && sscanf(str, "%f %f %f %f", &imgPlane.left, &imgPlane.right, &imgPlane.bottom,
+                                       &imgPlane.top) == 4;
+        str = getChildText(pCamera, "ImageResolution");
+        bool resolutionRead = str && sscanf(str, "%d %d", &imgPlane.nx, &imgPlane.ny) == 2;
+        if (!readChildVector(pCamera, "Position", pos) || !readChildVector(pCamera, "Gaze", gaze) ||
+                !readChildVector(pCamera, "Up", up) || !planeRead ||
+                !readChildFloat(pCamera, "NearDistance", imgPlane.distance) || !resolutionRead)
+            return parseError(xmlPath, "camera %d lacks its Position, Gaze, Up, NearPlane, NearDistance or "
+                              "ImageResolution", id);
+        str = getChildText(pCamera, "ImageName");
+        if (!str || strlen(str) >= sizeof(Camera::imageName))
+            return parseError(xmlPath, "ImageName of camera %d is missing or longer than %d characters", id,
+                              (int) sizeof(Camera::imageName) - 1);
+
+        cameras.push_back(new Camera(id, str, pos, gaze, up, imgPlane));
+        if (!cameras.back()->isValid())
+            return parseError(xmlPath, "camera %d has no pixels or an empty image plane", id);
 
         pCamera = pCamera->NextSiblingElement("Camera");
     }
 
     // Parse materals
     pElement = pRoot->FirstChildElement("Materials");
-    XMLElement *pMaterial = pElement->FirstChildElement("Material");
+    XMLElement *pMaterial = pElement ? pElement->FirstChildElement("Material") : nullptr;
     XMLElement *materialElement;
     while(pMaterial != nullptr)
     {
@@ -320,23 +217,13 @@ Scene::Scene(const char *xmlPath)
 
         int curr = materials.size() - 1;
 
-        eResult = pMaterial->QueryIntAttribute("id", &materials[curr]->id);
-        materialElement = pMaterial->FirstChildElement("AmbientReflectance");
-        str = materialElement->GetText();
-        sscanf(str, "%f %f %f", &materials[curr]->ambientRef.r, &materials[curr]->ambientRef.g, &materials[curr]->ambientRef.b);
-        materialElement = pMaterial->FirstChildElement("DiffuseReflectance");
-        str = materialElement->GetText();
-        sscanf(str, "%f %f %f", &materials[curr]->diffuseRef.r, &materials[curr]->diffuseRef.g, &materials[curr]->diffuseRef.b);
-        materialElement = pMaterial->FirstChildElement("SpecularReflectance");
-        str = materialElement->GetText();
-        sscanf(str, "%f %f %f", &materials[curr]->specularRef.r, &materials[curr]->specularRef.g, &materials[curr]->specularRef.b);
-        materialElement = pMaterial->FirstChildElement("MirrorReflectance");
-        if(materialElement != nullptr)
-        {
-            str = materialElement->GetText();
-            sscanf(str, "%f %f %f", &materials[curr]->mirrorRef.r, &materials[curr]->mirrorRef.g, &materials[curr]->mirrorRef.b);
-        }
-        else
+        pMaterial->QueryIntAttribute("id", &materials[curr]->id);
+        if (!readChildVector(pMaterial, "AmbientReflectance", materials[curr]->ambientRef) ||
+                !readChildVector(pMaterial, "DiffuseReflectance", materials[curr]->diffuseRef) ||
+                !readChildVector(pMaterial, "SpecularReflectance", materials[curr]->specularRef))
+            return parseError(xmlPath, "material %d lacks its AmbientReflectance, DiffuseReflectance or "
+                              "SpecularReflectance", curr + 1);
+        if (!readChildVector(pMaterial, "MirrorReflectance", materials[curr]->mirrorRef))
         {
             materials[curr]->mirrorRef.r = 0.0;
             materials[curr]->mirrorRef.g = 0.0;
@@ -351,49 +238,28 @@ Scene::Scene(const char *xmlPath)
 
     // Parse vertex data
     pElement = pRoot->FirstChildElement("VertexData");
-    int cursor = 0;
-    Vector3f tmpPoint;
-    str = pElement->GetText();
-    while(str[cursor] == ' ' || str[cursor] == '\t' || str[cursor] == '\n')
-        cursor++;
-    while(str[cursor] != '\0')
-    {
-        for(int cnt = 0 ; cnt < 3 ; cnt++)
-        {
-            if(cnt == 0)
-                tmpPoint.x = atof(str + cursor);
-            else if(cnt == 1)
-                tmpPoint.y = atof(str + cursor);
-            else
-                tmpPoint.z = atof(str + cursor);
-            while(str[cursor] != ' ' && str[cursor] != '\t' && str[cursor] != '\n')
-                cursor++;
-            while(str[cursor] == ' ' || str[cursor] == '\t' || str[cursor] == '\n')
-                cursor++;
-        }
-        vertices.push_back(tmpPoint);
-    }
+    if (pElement && !NumberParser::parseVertices(pElement->GetText(), vertices))
+        return parseError(xmlPath, "VertexData is not a list of x y z coordinates");
 
     // Parse objects
     pElement = pRoot->FirstChildElement("Objects");
+    if (!pElement)
+        return parseError(xmlPath, "no Objects");
 
     // Parse spheres
     XMLElement *pObject = pElement->FirstChildElement("Sphere");
     XMLElement *objElement;
     while(pObject != nullptr)
     {
-        int id;
+        int id = 0;
         int matIndex;
         int cIndex;
         float R;
 
-        eResult = pObject->QueryIntAttribute("id", &id);
-        objElement = pObject->FirstChildElement("Material");
-        eResult = objElement->QueryIntText(&matIndex);
-        objElement = pObject->FirstChildElement("Center");
-        eResult = objElement->QueryIntText(&cIndex);
-        objElement = pObject->FirstChildElement("Radius");
-        eResult = objElement->QueryFloatText(&R);
+        pObject->QueryIntAttribute("id", &id);
+        if (!readChildInt(pObject, "Material", matIndex) || !readChildInt(pObject, "Center", cIndex) ||
+                !readChildFloat(pObject, "Radius", R))
+            return parseError(xmlPath, "sphere %d lacks its Material, Center or Radius", id);
 
         objects.push_back(new Sphere(id, matIndex, cIndex, R));
 
@@ -404,93 +270,173 @@ Scene::Scene(const char *xmlPath)
     pObject = pElement->FirstChildElement("Triangle");
     while(pObject != nullptr)
     {
-        int id;
+        int id = 0;
         int matIndex;
         int p1Index;
         int p2Index;
         int p3Index;
 
-        eResult = pObject->QueryIntAttribute("id", &id);
-        objElement = pObject->FirstChildElement("Material");
-        eResult = objElement->QueryIntText(&matIndex);
-        objElement = pObject->FirstChildElement("Indices");
-        str = objElement->GetText();
-        sscanf(str, "%d %d %d", &p1Index, &p2Index, &p3Index);
+        pObject->QueryIntAttribute("id", &id);
+        str = getChildText(pObject, "Indices");
+        if (!readChildInt(pObject, "Material", matIndex) || !str ||
+                sscanf(str, "%d %d %d", &p1Index, &p2Index, &p3Index) != 3)
+            return parseError(xmlPath, "triangle %d lacks its Material or Indices", id);
 
         objects.push_back(new Triangle(id, matIndex, p1Index, p2Index, p3Index));
 
         pObject = pObject->NextSiblingElement("Triangle");
     }
 
-    // Parse meshes
+    // Parse meshes, a prototype mesh is only placed by its instances
+    unordered_map<int, const Mesh *> meshesById;
     pObject = pElement->FirstChildElement("Mesh");
     while(pObject != nullptr)
     {
-        int id;
+        int id = 0;
         int matIndex;
-        int p1Index;
-        int p2Index;
-        int p3Index;
-        int cursor = 0;
         int vertexOffset = 0;
+        bool prototype = false;
         vector<Triangle> faces;
 
-        eResult = pObject->QueryIntAttribute("id", &id);
-        objElement = pObject->FirstChildElement("Material");
-        eResult = objElement->QueryIntText(&matIndex);
-        objElement = pObject->FirstChildElement("Faces");
-        objElement->QueryIntAttribute("vertexOffset", &vertexOffset);
-        str = objElement->GetText();
-        while(str[cursor] == ' ' || str[cursor] == '\t' || str[cursor] == '\n')
-            cursor++;
-        while(str[cursor] != '\0')
-        {
-            for(int cnt = 0 ; cnt < 3 ; cnt++)
-            {
-                if(cnt == 0)
-                    p1Index = atoi(str + cursor) + vertexOffset;
-                else if(cnt == 1)
-                    p2Index = atoi(str + cursor) + vertexOffset;
-                else
-                    p3Index = atoi(str + cursor) + vertexOffset;
-                while(str[cursor] != ' ' && str[cursor] != '\t' && str[cursor] != '\n')
-                    cursor++;
-                while(str[cursor] == ' ' || str[cursor] == '\t' || str[cursor] == '\n')
-                    cursor++;
-            }
-            faces.push_back(*(new Triangle(-1, matIndex, p1Index, p2Index, p3Index)));
+        pObject->QueryIntAttribute("id", &id);
+        pObject->QueryBoolAttribute("prototype", &prototype);
+        if (!readChildInt(pObject, "Material", matIndex))
+            return parseError(xmlPath, "mesh %d has no Material", id);
+        objElement = pObject->FirstChildElement("File");
+        if (objElement) {
+            // Vertices and faces of an OBJ or PLY file, relative paths start from the directory of the XML file
+            string path = objElement->GetText() ? objElement->GetText() : "";
+            const char *slash = strrchr(xmlPath, '/');
+            if (!path.empty() && path[0] != '/' && slash)
+                path = string(xmlPath, slash + 1) + path;
+            if (!MeshFile::load(path.c_str(), matIndex, vertices, faces))
+                return parseError(xmlPath, "mesh %d cannot be read from %s", id, path.c_str());
+            meshFiles.push_back(path);
+        }
+        else {
+            objElement = pObject->FirstChildElement("Faces");
+            if (!objElement)
+                return parseError(xmlPath, "mesh %d has neither Faces nor a File", id);
+            objElement->QueryIntAttribute("vertexOffset", &vertexOffset);
+            if (!NumberParser::parseFaces(objElement->GetText(), vertexOffset, matIndex, faces))
+                return parseError(xmlPath, "Faces of mesh %d are not a list of vertex index triples", id);
         }
 
-        objects.push_back(new Mesh(id, matIndex, faces));
+        Mesh *mesh = new Mesh(id, matIndex, move(faces), prototype);
+        objects.push_back(mesh);
+        meshesById[id] = mesh;
 
         pObject = pObject->NextSiblingElement("Mesh");
     }
 
+    // Parse instances, copies of a mesh placed by the rows of an affine transform that share its faces
+    pObject = pElement->FirstChildElement("Instance");
+    while(pObject != nullptr)
+    {
+        int id = 0;
+        int meshId = -1;
+        Transform transform, inverse;
+
+        pObject->QueryIntAttribute("id", &id);
+        readChildInt(pObject, "Mesh", meshId);
+        auto found = meshesById.find(meshId);
+        const Mesh *mesh = found != meshesById.end() ? found->second : nullptr;
+
+        // The last row of a 4x4 matrix is left out, an affine transform keeps it at 0 0 0 1
+        int count = 0;
+        str = getChildText(pObject, "Transform");
+        if (str) {
+            char *next;
+            for (float value = strtof(str, &next); next != str; value = strtof(str, &next)) {
+                if (count < 12)
+                    transform.m[count / 4][count % 4] = value;
+                count++;
+                str = next;
+            }
+        }
+
+        if (!mesh)
+            return parseError(xmlPath, "Instance %d refers to no mesh", id);
+        if (count != 12 && count != 16)
+            return parseError(xmlPath, "Transform of instance %d is not a row major 3x4 or 4x4 matrix", id);
+        if (!invertTransform(transform, inverse))
+            return parseError(xmlPath, "Transform of instance %d cannot be inverted", id);
+        int matIndex = mesh->matIndex;
+        readChildInt(pObject, "Material", matIndex);
+        objects.push_back(new Instance(id, matIndex, mesh, transform, inverse));
+
+        pObject = pObject->NextSiblingElement("Instance");
+    }
+
+    // Mesh files add vertices as they are read, so indices are checked once every shape is
+    for (const Shape * object : objects) {
+        if (!object->hasValidIndices(*this))
+            return parseError(xmlPath, "shape %d refers to a material or vertex that does not exist", object->id);
+    }
+
     // Parse lights
     int id;
     Vector3f position;
     Vector3f intensity;
     pElement = pRoot->FirstChildElement("Lights");
+    if (!pElement || !readChildVector(pElement, "AmbientLight", ambientLight))
+        return parseError(xmlPath, "Lights have no AmbientLight");
 
-    XMLElement *pLight = pElement->FirstChildElement("AmbientLight");
-    XMLElement *lightElement;
-    str = pLight->GetText();
-    sscanf(str, "%f %f %f", &ambientLight.r, &ambientLight.g, &ambientLight.b);
-
-    pLight = pElement->FirstChildElement("PointLight");
+    XMLElement *pLight = pElement->FirstChildElement("PointLight");
     while(pLight != nullptr)
     {
-        eResult = pLight->QueryIntAttribute("id", &id);
-        lightElement = pLight->FirstChildElement("Position");
-        str = lightElement->GetText();
-        sscanf(str, "%f %f %f", &position.x, &position.y, &position.z);
-        lightElement = pLight->FirstChildElement("Intensity");
-        str = lightElement->GetText();
-        sscanf(str, "%f %f %f", &intensity.r, &intensity.g, &intensity.b);
+        id = 0;
+        pLight->QueryIntAttribute("id", &id);
+        if (!readChildVector(pLight, "Position", position) || !readChildVector(pLight, "Intensity", intensity))
+            return parseError(xmlPath, "light %d lacks its Position or Intensity", id);
 
         lights.push_back(new PointLight(position, intensity));
 
         pLight = pLight->NextSiblingElement("PointLight");
     }
+
+    bindShadingKernels();
+    lightTree = new LightTree(lights);
+    return true;
+}
+
+// Empty scene, filled by parseXML or SceneFile
+Scene::Scene()
+{
+    setDefaults();
+}
+
+// Values of everything the scene file may leave out, and of the render options
+void Scene::setDefaults()
+{
+    maxRecursionDepth = 1;
+    shadowRayEps = 0.001;
+    intTestEps = 0.0f;
+    bvh = nullptr;
+    bvhMethod = BVH::SweepSAH;
+    rebuildThreshold = 1.5f;
+    packetSize = 1;
+    renderMode = Recursive;
+    minContribution = 0.0f;
+    lightTree = nullptr;
+    lightCutoff = 0.0f;
+    occluderCache = true;
+    shadowStats = ShadowStats();
+    renderer = nullptr;
+}
+
+Scene::~Scene()
+{
+    delete renderer;
+    delete lightTree;
+    delete bvh;
+    for (Shape * object : objects)
+        delete object;
+    for (Material * material : materials)
+        delete material;
+    for (PointLight * light : lights)
+        delete light;
+    for (Camera * camera : cameras)
+        delete camera;
 }
 
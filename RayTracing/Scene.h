@@ -8,13 +8,16 @@
 #include <string>
 #include <vector>
 
+#include "BVH.h"
 #include "Ray.h"
 #include "defs.h"
 
 // Forward declarations to avoid cyclic references
 class Camera;
 class PointLight;
+class LightTree;
 class Material;
+class Renderer;
 class Shape;
 
 using namespace std;
@@ -23,7 +26,14 @@ using namespace std;
 class Scene
 {
 public:
+	enum RenderMode
+	{
+		Recursive,	// Follows the rays of each pixel depth first
+		Wavefront	// Processes the rays of a tile stage by stage, see renderWavefrontTile
+	};
+
 	int maxRecursionDepth;			// Maximum recursion depth
+	static const int maxRecursionLimit = 1024;	// Largest maxRecursionDepth a scene may ask for, each reflection level costs a pass over its rays
 	float intTestEps;				// IntersectionTestEpsilon. You will need this one while implementing intersect routines in Shape class
 	float shadowRayEps;				// ShadowRayEpsilon. You will need this one while generating shadow rays. 
 	Vector3f backgroundColor;		// Background color
@@ -34,13 +44,38 @@ public:
 	vector<Material *> materials;	// Vector holding all materials
 	vector<Vector3f> vertices;		// Vector holding all vertices (vertex data)
 	vector<Shape *> objects;		// Vector holding all shapes
+	vector<string> meshFiles;		// OBJ and PLY files the meshes were read from, the scene is outdated once they change
+	BVH * bvh;						// Acceleration structure over all shapes, built after parsing
+	float rebuildThreshold;			// BVH is rebuilt instead of refitted once refitting made its SAH cost this many times worse
+	int packetSize;					// Side of the square blocks of pixels whose primary rays are traced as one packet, 1 traces every pixel on its own
+	RenderMode renderMode;			// Renderer used by renderScene, both produce the same image
+	LightTree * lightTree;			// Hierarchy over the lights, built with the scene
+	float lightCutoff;				// Lights whose irradiance at a point is below this are not used to shade it, 0 uses every light
+	float minContribution;			// Mirror reflections that can change a pixel by less than this many output levels are not traced, 0 only skips those that cannot change it, anything more approximates the image
+	bool occluderCache;				// Shadow rays first test the shape that last blocked a shadow ray towards the same light on the same thread
+	ShadowStats shadowStats;		// Shadow ray counters of the last renderScene
 
-	Scene(const char *xmlPath);		// Constructor. Parses XML file and initializes vectors above. Implemented for you. 
+	static Scene * parse(const char *xmlPath);	// Parses XML file and initializes vectors above, nullptr with the reason on stderr if the file is malformed
+	~Scene();						// Frees everything the scene owns, must not be called while it is being rendered
+	Scene(const Scene &) = delete;	// Shapes refer to the scene's vertices and materials by index, a scene is not copied
+	Scene & operator=(const Scene &) = delete;
 
-	void renderScene(void);			// Method to render scene, an image is created for each camera in the scene. You will implement this. 
+	void buildBVH(BVH::BuildMethod method);	// Builds the acceleration structure over the parsed shapes. Must be called before rendering.
+	bool updateVertices(const vector<Vector3f> & newVertices);	// Moves the vertices of a deforming scene (same count and topology) and refits the BVH to them, false if the count differs
+	void renderScene(void);			// Method to render scene, an image is created for each camera in the scene and saved, see Renderer to render into images of your own
 
 private:
     // Write any other stuff here
+    BVH::BuildMethod bvhMethod;     // Builder used for the BVH, also used for rebuilds
+    Renderer * renderer;            // Renderer of renderScene, started by its first call
+
+    friend class SceneFile;         // Restores scenes through the empty constructor
+    Scene();
+
+    bool parseXML(const char *xmlPath);
+    void setDefaults();
+    void updateMeshes();
+    void bindShadingKernels();
 };
 
 #endif
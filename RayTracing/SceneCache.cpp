@@ -0,0 +1,59 @@
+#include "SceneCache.h"
+#include <sys/stat.h>
+
+// Modification time of a file, 0 if it is gone
+static timespec getModified(const string & path)
+{
+    struct stat status;
+    if (stat(path.c_str(), &status) != 0)
+        return timespec();
+    return status.st_mtim;
+}
+
+static bool operator==(const timespec & a, const timespec & b)
+{
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+SceneCache::SceneCache(int capacity, const function<Scene *(const char *)> & load)
+    : capacity(max(capacity, 1)), load(load)
+{
+}
+
+Scene * SceneCache::get(const string & path, bool & cached)
+{
+    struct stat status;
+    if (stat(path.c_str(), &status) != 0 || !S_ISREG(status.st_mode))
+        return nullptr;
+
+    for (auto entry = entries.begin(); entry != entries.end(); ++entry) {
+        if (entry->path != path)
+            continue;
+        bool current = entry->modified == status.st_mtim;
+        const vector<string> & meshFiles = entry->scene->meshFiles;
+        for (int i = 0; current && i < (int) meshFiles.size(); ++i)
+            current = entry->meshFilesModified[i] == getModified(meshFiles[i]);
+        if (current) {
+            entries.splice(entries.begin(), entries, entry);
+            cached = true;
+            return entries.front().scene.get();
+        }
+        // The files changed since they were parsed
+        entries.erase(entry);
+        break;
+    }
+
+    // Drop the least recently used scenes first, so that they are freed before the new one is parsed
+    while ((int) entries.size() >= capacity)
+        entries.pop_back();
+
+    unique_ptr<Scene> scene(load(path.c_str()));
+    if (!scene)
+        return nullptr;
+    vector<timespec> meshFilesModified;
+    for (const string & meshFile : scene->meshFiles)
+        meshFilesModified.push_back(getModified(meshFile));
+    entries.push_front({path, status.st_mtim, meshFilesModified, move(scene)});
+    cached = false;
+    return entries.front().scene.get();
+}
@@ -0,0 +1,40 @@
+#ifndef _SCENECACHE_H_
+#define _SCENECACHE_H_
+
+#include <ctime>
+#include <functional>
+#include <list>
+#include <memory>
+#include <string>
+#include "Scene.h"
+
+using namespace std;
+
+/* Parsed scenes, ready to render, kept for the requests to come. A scene is identified by the path of its file and the
+time the file was last modified, so editing a scene file, or a mesh file it refers to, makes the next request parse
+it again. At most capacity scenes are kept, the least recently used one is dropped to make room for another. */
+class SceneCache
+{
+public:
+    // load reads the scene of a file ready to render, e.g. parsed with its BVH built, nullptr if it cannot
+    SceneCache(int capacity, const function<Scene *(const char *)> & load);
+
+    /* Returns the scene of the file at path, loading it if it is not cached, nullptr if the file cannot be read.
+    cached is set to whether the scene came from the cache. The scene stays valid until the next call. */
+    Scene * get(const string & path, bool & cached);
+
+private:
+    typedef struct Entry
+    {
+        string path;
+        timespec modified;      // Modification time of the file when it was parsed
+        vector<timespec> meshFilesModified;   // Likewise for the mesh files of the scene
+        unique_ptr<Scene> scene;
+    } Entry;
+
+    list<Entry> entries;        // Most recently used first
+    int capacity;
+    function<Scene *(const char *)> load;
+};
+
+#endif
@@ -0,0 +1,555 @@
+#include "SceneFile.h"
+#include "Scene.h"
+#include "Camera.h"
+#include "Light.h"
+#include "LightTree.h"
+#include "Material.h"
+#include "Shape.h"
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <type_traits>
+#include <unistd.h>
+#include <unordered_map>
+
+// Written at the start of every scene file, the version changes with any change of the format
+const char sceneFileMagic[8] = "RTSCENE";
+const uint32_t sceneFileVersion = 4;
+
+// Kinds of objects, in the order of the scene's objects
+enum ObjectType
+{
+    SphereObject,
+    TriangleObject,
+    MeshObject,
+    InstanceObject
+};
+
+// Appends values and arrays of plain data to a buffer
+class SceneWriter
+{
+public:
+    vector<char> data;
+
+    template <typename T>
+    void put(const T & value) {
+        const char * bytes = reinterpret_cast<const char *>(&value);
+        data.insert(data.end(), bytes, bytes + sizeof(T));
+    }
+
+    template <typename T>
+    void putArray(const vector<T> & values) {
+        put((uint64_t) values.size());
+        const char * bytes = reinterpret_cast<const char *>(values.data());
+        data.insert(data.end(), bytes, bytes + values.size() * sizeof(T));
+    }
+};
+
+// Reads back what a SceneWriter wrote, failing instead of reading past the end
+class SceneReader
+{
+public:
+    SceneReader(const char * begin, const char * end) : cursor(begin), end(end) {}
+
+    template <typename T>
+    bool get(T & value) {
+        if (end - cursor < (ptrdiff_t) sizeof(T))
+            return false;
+        memcpy(&value, cursor, sizeof(T));
+        cursor += sizeof(T);
+        return true;
+    }
+
+    template <typename T>
+    bool getArray(vector<T> & values) {
+        uint64_t count;
+        if (!get(count) || count > (uint64_t) (end - cursor) / sizeof(T))
+            return false;
+        values.resize(count);
+        memcpy(values.data(), cursor, count * sizeof(T));
+        cursor += count * sizeof(T);
+        return true;
+    }
+
+    // Makes a copy of an object written as bytes, for types without a default constructor
+    template <typename T>
+    T * getObject() {
+        typename aligned_storage<sizeof(T), alignof(T)>::type storage;
+        if (!get(storage))
+            return nullptr;
+        return new T(*reinterpret_cast<const T *>(&storage));
+    }
+
+private:
+    const char * cursor;
+    const char * end;
+};
+
+// Position of a primitive of the BVH among the scene's objects, faceIndex is -1 for objects that are not meshes
+typedef struct PrimitiveLocation
+{
+    int objectIndex;
+    int faceIndex;
+    int index;      // Flattened index, see BVH::Primitive
+} PrimitiveLocation;
+
+// Size and modification time of a file the scene was read from
+static void putFileTime(SceneWriter & writer, const struct stat & status)
+{
+    writer.put((int64_t) status.st_size);
+    writer.put((int64_t) status.st_mtim.tv_sec);
+    writer.put((int64_t) status.st_mtim.tv_nsec);
+}
+
+// Identifies both the build of the renderer and the XML file a scene file was written for
+void SceneFile::putStamp(SceneWriter & writer, const struct stat & xmlStatus)
+{
+    writer.put(sceneFileMagic);
+    writer.put(sceneFileVersion);
+    uint32_t layout[] = {sizeof(Camera), sizeof(PointLight), sizeof(Material), sizeof(Vector3f),
+                         sizeof(BVH::WideNode), sizeof(BVH::Leaf), BVH_WIDTH, TRIANGLE_BLOCK_WIDTH, SPHERE_BLOCK_WIDTH};
+    writer.put(layout);
+    putFileTime(writer, xmlStatus);
+}
+
+// Writes a tree, then the trees of its instanced meshes each after the object index of its mesh
+void SceneFile::putBVH(SceneWriter & writer, const BVH & bvh,
+        const unordered_map<const Shape *, pair<int, int>> & locations)
+{
+    writer.putArray(bvh.wideNodes);
+    writer.putArray(bvh.leaves);
+    for (int axis = 0; axis < 3; ++axis) {
+        writer.putArray(bvh.triangles.vertex[axis]);
+        writer.putArray(bvh.triangles.edge1[axis]);
+        writer.putArray(bvh.triangles.edge2[axis]);
+    }
+    writer.putArray(bvh.triangles.normals);
+    writer.putArray(bvh.triangles.materialIds);
+    for (int axis = 0; axis < 3; ++axis)
+        writer.putArray(bvh.spheres.center[axis]);
+    writer.putArray(bvh.spheres.radiusSquare);
+    writer.putArray(bvh.spheres.materialIds);
+
+    for (const vector<BVH::Primitive> * primitives :
+            {&bvh.trianglePrimitives, &bvh.spherePrimitives, &bvh.instancePrimitives}) {
+        vector<PrimitiveLocation> primitiveLocations;
+        for (const BVH::Primitive & primitive : *primitives) {
+            pair<int, int> location = locations.at(primitive.shape);
+            primitiveLocations.push_back({location.first, location.second, primitive.index});
+        }
+        writer.putArray(primitiveLocations);
+    }
+    writer.put((uint64_t) bvh.binaryNodeMemory);
+    writer.put(bvh.builtCost);
+    writer.put(bvh.currentCost);
+    writer.put(bvh.bounds);
+
+    writer.put((uint64_t) bvh.meshBVHs.size());
+    for (int i = 0; i < (int) bvh.meshBVHs.size(); ++i) {
+        writer.put(locations.at(bvh.instancedMeshes[i]).first);
+        putBVH(writer, *bvh.meshBVHs[i], locations);
+    }
+}
+
+string SceneFile::getPath(const char * xmlPath)
+{
+    return string(xmlPath) + ".bin";
+}
+
+bool SceneFile::save(const Scene & scene, const char * xmlPath)
+{
+    struct stat xmlStatus;
+    if (stat(xmlPath, &xmlStatus) != 0)
+        return false;
+
+    SceneWriter writer;
+    putStamp(writer, xmlStatus);
+
+    // The mesh files are stamped too, the scene file is outdated once any of them changes
+    writer.put((uint64_t) scene.meshFiles.size());
+    for (const string & meshFile : scene.meshFiles) {
+        struct stat meshStatus;
+        if (stat(meshFile.c_str(), &meshStatus) != 0)
+            return false;
+        writer.putArray(vector<char>(meshFile.begin(), meshFile.end()));
+        putFileTime(writer, meshStatus);
+    }
+
+    writer.put(scene.maxRecursionDepth);
+    writer.put(scene.intTestEps);
+    writer.put(scene.shadowRayEps);
+    writer.put(scene.backgroundColor);
+    writer.put(scene.ambientLight);
+
+    // Cameras, lights and materials only hold floats, ints and chars, they are written as they are in memory
+    writer.put((uint64_t) scene.cameras.size());
+    for (const Camera * camera : scene.cameras)
+        writer.put(*camera);
+    writer.put((uint64_t) scene.lights.size());
+    for (const PointLight * light : scene.lights)
+        writer.put(*light);
+    writer.put((uint64_t) scene.materials.size());
+    for (const Material * material : scene.materials)
+        writer.put(*material);
+    writer.putArray(scene.vertices);
+
+    // Where every shape is, so that the primitives of the BVH can refer to them
+    unordered_map<const Shape *, pair<int, int>> locations;
+    writer.put((uint64_t) scene.objects.size());
+    for (int i = 0; i < (int) scene.objects.size(); ++i) {
+        const Shape * object = scene.objects[i];
+        locations[object] = {i, -1};
+        writer.put(object->id);
+        writer.put(object->matIndex);
+        if (const Sphere * sphere = dynamic_cast<const Sphere *>(object)) {
+            writer.put((int) SphereObject);
+            writer.put(sphere->centerIndex);
+            writer.put(sphere->radius);
+        }
+        else if (const Triangle * triangle = dynamic_cast<const Triangle *>(object)) {
+            writer.put((int) TriangleObject);
+            writer.put(triangle->p1index);
+            writer.put(triangle->p2index);
+            writer.put(triangle->p3index);
+        }
+        else if (const Instance * instance = dynamic_cast<const Instance *>(object)) {
+            // Meshes are parsed before their instances, so the mesh has been written already
+            writer.put((int) InstanceObject);
+            writer.put(locations[instance->mesh].first);
+            writer.put(instance->transform);
+            writer.put(instance->inverse);
+        }
+        else {
+            const Mesh * mesh = static_cast<const Mesh *>(object);
+            writer.put((int) MeshObject);
+            vector<int> faceIndices;
+            faceIndices.reserve(3 * mesh->triangles.size());
+            for (int f = 0; f < (int) mesh->triangles.size(); ++f) {
+                const Triangle & face = mesh->triangles[f];
+                locations[&face] = {i, f};
+                faceIndices.insert(faceIndices.end(), {face.p1index, face.p2index, face.p3index});
+            }
+            writer.putArray(faceIndices);
+            writer.put((int) mesh->prototype);
+        }
+    }
+
+    const BVH * bvh = scene.bvh;
+    writer.put((int) (bvh != nullptr));
+    if (bvh) {
+        writer.put((int) scene.bvhMethod);
+        putBVH(writer, *bvh, locations);
+    }
+
+    // Written aside and renamed, so that a reader never sees a partial file
+    string path = getPath(xmlPath);
+    string partialPath = path + "." + to_string(getpid());
+    FILE * file = fopen(partialPath.c_str(), "wb");
+    if (!file)
+        return false;
+    bool written = fwrite(writer.data.data(), 1, writer.data.size(), file) == writer.data.size();
+    written = fclose(file) == 0 && written;
+    if (!written || rename(partialPath.c_str(), path.c_str()) != 0) {
+        remove(partialPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Reads the objects of the scene, false if the file is inconsistent
+bool SceneFile::readObjects(SceneReader & reader, Scene * scene)
+{
+    uint64_t objectCount;
+    if (!reader.get(objectCount))
+        return false;
+    int vertexCount = scene->vertices.size();
+    for (uint64_t i = 0; i < objectCount; ++i) {
+        int id, matIndex, type;
+        if (!reader.get(id) || !reader.get(matIndex) || !reader.get(type))
+            return false;
+        if (matIndex < 1 || matIndex > (int) scene->materials.size())
+            return false;
+        if (type == SphereObject) {
+            int centerIndex;
+            float radius;
+            if (!reader.get(centerIndex) || !reader.get(radius) || centerIndex < 1 || centerIndex > vertexCount)
+                return false;
+            scene->objects.push_back(new Sphere(id, matIndex, centerIndex, radius));
+            continue;
+        }
+        if (type == InstanceObject) {
+            int meshIndex;
+            Transform transform, inverse;
+            if (!reader.get(meshIndex) || !reader.get(transform) || !reader.get(inverse) ||
+                    meshIndex < 0 || meshIndex >= (int) scene->objects.size())
+                return false;
+            const Mesh * mesh = dynamic_cast<const Mesh *>(scene->objects[meshIndex]);
+            if (!mesh)
+                return false;
+            scene->objects.push_back(new Instance(id, matIndex, mesh, transform, inverse));
+            continue;
+        }
+        if (type != TriangleObject && type != MeshObject)
+            return false;
+
+        vector<int> indices(3);
+        if (type == TriangleObject && (!reader.get(indices[0]) || !reader.get(indices[1]) || !reader.get(indices[2])))
+            return false;
+        int prototype = 0;
+        if (type == MeshObject && (!reader.getArray(indices) || indices.size() % 3 != 0 || !reader.get(prototype)))
+            return false;
+        for (int index : indices) {
+            if (index < 1 || index > vertexCount)
+                return false;
+        }
+        if (type == TriangleObject) {
+            scene->objects.push_back(new Triangle(id, matIndex, indices[0], indices[1], indices[2]));
+            continue;
+        }
+        Mesh * mesh = new Mesh();
+        mesh->id = id;
+        mesh->matIndex = matIndex;
+        mesh->prototype = prototype != 0;
+        mesh->triangles.reserve(indices.size() / 3);
+        for (int f = 0; f < (int) indices.size(); f += 3)
+            mesh->triangles.push_back(Triangle(-1, matIndex, indices[f], indices[f + 1], indices[f + 2]));
+        scene->objects.push_back(mesh);
+    }
+    return true;
+}
+
+// Reads the BVH over the objects of the scene, nullptr if the file is inconsistent
+BVH * SceneFile::readBVH(SceneReader & reader, const Scene * scene)
+{
+    BVH * bvh = new BVH();
+    bool valid = reader.getArray(bvh->wideNodes) && reader.getArray(bvh->leaves);
+    for (int axis = 0; valid && axis < 3; ++axis) {
+        valid = reader.getArray(bvh->triangles.vertex[axis]) && reader.getArray(bvh->triangles.edge1[axis]) &&
+                reader.getArray(bvh->triangles.edge2[axis]);
+    }
+    valid = valid && reader.getArray(bvh->triangles.normals) && reader.getArray(bvh->triangles.materialIds);
+    for (int axis = 0; valid && axis < 3; ++axis)
+        valid = reader.getArray(bvh->spheres.center[axis]);
+    valid = valid && reader.getArray(bvh->spheres.radiusSquare) && reader.getArray(bvh->spheres.materialIds);
+
+    // Primitives refer to the shapes just read
+    vector<BVH::Primitive> * primitives[] = {&bvh->trianglePrimitives, &bvh->spherePrimitives,
+                                             &bvh->instancePrimitives};
+    for (int type = 0; valid && type < 3; ++type) {
+        vector<PrimitiveLocation> locations;
+        valid = reader.getArray(locations);
+        for (int i = 0; valid && i < (int) locations.size(); ++i) {
+            const PrimitiveLocation & location = locations[i];
+            valid = location.objectIndex >= 0 && (size_t) location.objectIndex < scene->objects.size();
+            if (!valid)
+                break;
+            // Triangles are faces of a mesh or triangle objects, spheres and instances are objects of their own type
+            const Shape * shape = scene->objects[location.objectIndex];
+            if (location.faceIndex >= 0) {
+                const Mesh * mesh = dynamic_cast<const Mesh *>(shape);
+                valid = type == 0 && mesh && (size_t) location.faceIndex < mesh->triangles.size();
+                if (valid)
+                    shape = &mesh->triangles[location.faceIndex];
+            }
+            else if (type == 0)
+                valid = dynamic_cast<const Triangle *>(shape) != nullptr;
+            else if (type == 1)
+                valid = dynamic_cast<const Sphere *>(shape) != nullptr;
+            else
+                valid = dynamic_cast<const Instance *>(shape) != nullptr;
+            primitives[type]->push_back({shape, location.index});
+        }
+    }
+    uint64_t binaryNodeMemory = 0;
+    valid = valid && reader.get(binaryNodeMemory) && reader.get(bvh->builtCost) && reader.get(bvh->currentCost) &&
+            reader.get(bvh->bounds);
+    bvh->binaryNodeMemory = binaryNodeMemory;
+
+    // Trees of the instanced meshes, every instance needing the one of its mesh
+    uint64_t meshBVHCount = 0;
+    valid = valid && reader.get(meshBVHCount);
+    for (uint64_t i = 0; valid && i < meshBVHCount; ++i) {
+        int meshIndex;
+        valid = reader.get(meshIndex) && meshIndex >= 0 && meshIndex < (int) scene->objects.size();
+        const Mesh * mesh = valid ? dynamic_cast<const Mesh *>(scene->objects[meshIndex]) : nullptr;
+        BVH * meshBVH = mesh ? readBVH(reader, scene) : nullptr;
+        // A mesh stored twice would leave one of its trees unused
+        valid = meshBVH != nullptr && !bvh->getMeshBVH(mesh);
+        if (valid)
+            bvh->addMeshBVH(mesh, meshBVH);
+        else
+            delete meshBVH;
+    }
+    for (int i = 0; valid && i < (int) bvh->instancePrimitives.size(); ++i) {
+        const Instance * instance = static_cast<const Instance *>(bvh->instancePrimitives[i].shape);
+        valid = bvh->getMeshBVH(instance->getMesh()) != nullptr;
+    }
+
+    // Arrays are padded to whole blocks, and every range traversal may follow has to be inside them
+    size_t triangleCount = bvh->trianglePrimitives.size();
+    size_t sphereCount = bvh->spherePrimitives.size();
+    for (int axis = 0; valid && axis < 3; ++axis) {
+        valid = bvh->triangles.vertex[axis].size() == bvh->triangles.edge1[axis].size() &&
+                bvh->triangles.vertex[axis].size() == bvh->triangles.edge2[axis].size() &&
+                bvh->triangles.vertex[axis].size() >= triangleCount + TRIANGLE_BLOCK_WIDTH &&
+                bvh->spheres.center[axis].size() == bvh->spheres.radiusSquare.size();
+    }
+    valid = valid && bvh->triangles.normals.size() == triangleCount && bvh->triangles.materialIds.size() == triangleCount &&
+            bvh->spheres.materialIds.size() == sphereCount && bvh->spheres.radiusSquare.size() >= sphereCount + SPHERE_BLOCK_WIDTH &&
+            !bvh->wideNodes.empty();
+    /* Children come after their parent, so the depth of a node is known when it is reached. A node that is the child
+    of two nodes would make the tree a graph whose depth this does not bound. */
+    vector<int> depths(bvh->wideNodes.size(), 0);
+    vector<bool> referenced(bvh->wideNodes.size(), false);
+    for (int i = 0; valid && i < (int) bvh->wideNodes.size(); ++i) {
+        const BVH::WideNode & node = bvh->wideNodes[i];
+        int innerCount = 0;
+        int leafCount = 0;
+        for (int child = 0; child < node.childCount; ++child)
+            (node.leafSize[child] ? leafCount : innerCount)++;
+        valid = node.childCount <= BVH_WIDTH && (innerCount == 0 || node.childBase > i) &&
+                node.childBase + innerCount <= (int) bvh->wideNodes.size() &&
+                node.leafBase >= 0 && node.leafBase + leafCount <= (int) bvh->leaves.size() &&
+                depths[i] <= BVH::maxDepth;
+        for (int child = 0; valid && child < innerCount; ++child) {
+            valid = !referenced[node.childBase + child];
+            referenced[node.childBase + child] = true;
+            depths[node.childBase + child] = depths[i] + 1;
+        }
+    }
+    for (int i = 0; valid && i < (int) bvh->leaves.size(); ++i) {
+        const BVH::Leaf & leaf = bvh->leaves[i];
+        valid = leaf.triangleBegin >= 0 && (size_t) leaf.triangleBegin + leaf.triangleCount <= triangleCount &&
+                leaf.sphereBegin >= 0 && (size_t) leaf.sphereBegin + leaf.sphereCount <= sphereCount &&
+                leaf.instanceBegin >= 0 && (size_t) leaf.instanceBegin + leaf.instanceCount <= bvh->instancePrimitives.size();
+    }
+    for (size_t i = 0; valid && i < triangleCount; ++i)
+        valid = bvh->triangles.materialIds[i] >= 1 && bvh->triangles.materialIds[i] <= (int) scene->materials.size();
+    for (size_t i = 0; valid && i < sphereCount; ++i)
+        valid = bvh->spheres.materialIds[i] >= 1 && bvh->spheres.materialIds[i] <= (int) scene->materials.size();
+    if (!valid) {
+        delete bvh;
+        return nullptr;
+    }
+    bvh->triangles.intTestEps = scene->intTestEps;
+    bvh->spheres.intTestEps = scene->intTestEps;
+    bvh->setInstanceRecords();
+    return bvh;
+}
+
+// Reads everything after the stamp, false if the file is inconsistent or a mesh file changed since it was written
+bool SceneFile::readScene(SceneReader & reader, Scene * scene, BVH::BuildMethod method)
+{
+    uint64_t meshFileCount;
+    if (!reader.get(meshFileCount))
+        return false;
+    for (uint64_t i = 0; i < meshFileCount; ++i) {
+        vector<char> meshFile;
+        int64_t stored[3];
+        if (!reader.getArray(meshFile) || !reader.get(stored))
+            return false;
+        scene->meshFiles.push_back(string(meshFile.begin(), meshFile.end()));
+        struct stat meshStatus;
+        SceneWriter current;
+        if (stat(scene->meshFiles.back().c_str(), &meshStatus) != 0)
+            return false;
+        putFileTime(current, meshStatus);
+        if (memcmp(current.data.data(), stored, sizeof(stored)) != 0)
+            return false;
+    }
+
+    if (!reader.get(scene->maxRecursionDepth) || !reader.get(scene->intTestEps) || !reader.get(scene->shadowRayEps) ||
+            !reader.get(scene->backgroundColor) || !reader.get(scene->ambientLight))
+        return false;
+    if (scene->maxRecursionDepth < 0 || scene->maxRecursionDepth > Scene::maxRecursionLimit)
+        return false;
+
+    uint64_t count;
+    if (!reader.get(count))
+        return false;
+    // Cameras are checked like the ones of the XML file, their sizes and image names are used as they are
+    for (uint64_t i = 0; i < count; ++i) {
+        Camera * camera = reader.getObject<Camera>();
+        if (!camera)
+            return false;
+        scene->cameras.push_back(camera);
+        if (!camera->isValid())
+            return false;
+    }
+    if (!reader.get(count))
+        return false;
+    for (uint64_t i = 0; i < count; ++i) {
+        PointLight * light = reader.getObject<PointLight>();
+        if (!light)
+            return false;
+        scene->lights.push_back(light);
+    }
+    if (!reader.get(count))
+        return false;
+    for (uint64_t i = 0; i < count; ++i) {
+        Material * material = reader.getObject<Material>();
+        if (!material)
+            return false;
+        scene->materials.push_back(material);
+    }
+    if (!reader.getArray(scene->vertices) || !readObjects(reader, scene))
+        return false;
+
+    int hasBVH, builtMethod;
+    if (!reader.get(hasBVH))
+        return false;
+    if (hasBVH) {
+        if (!reader.get(builtMethod))
+            return false;
+        // A tree of another builder is left out, the scene then gets one built with method
+        if (builtMethod == method) {
+            scene->bvh = readBVH(reader, scene);
+            if (!scene->bvh)
+                return false;
+            scene->bvhMethod = method;
+        }
+    }
+
+    scene->bindShadingKernels();
+    scene->lightTree = new LightTree(scene->lights);
+    scene->updateMeshes();
+    return true;
+}
+
+Scene * SceneFile::load(const char * xmlPath, BVH::BuildMethod method)
+{
+    struct stat xmlStatus;
+    if (stat(xmlPath, &xmlStatus) != 0)
+        return nullptr;
+    int descriptor = open(getPath(xmlPath).c_str(), O_RDONLY);
+    if (descriptor < 0)
+        return nullptr;
+    struct stat fileStatus;
+    void * mapping = MAP_FAILED;
+    if (fstat(descriptor, &fileStatus) == 0 && fileStatus.st_size > 0)
+        mapping = mmap(nullptr, fileStatus.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    close(descriptor);
+    if (mapping == MAP_FAILED)
+        return nullptr;
+
+    // The stamp has to be exactly the one this build would write for the XML file as it is now
+    const char * begin = static_cast<const char *>(mapping);
+    SceneWriter stamp;
+    putStamp(stamp, xmlStatus);
+    Scene * scene = nullptr;
+    bool valid = fileStatus.st_size >= (off_t) stamp.data.size() && memcmp(begin, stamp.data.data(), stamp.data.size()) == 0;
+    if (valid) {
+        SceneReader reader(begin + stamp.data.size(), begin + fileStatus.st_size);
+        scene = new Scene();
+        valid = readScene(reader, scene, method);
+    }
+
+    munmap(mapping, fileStatus.st_size);
+    if (!valid) {
+        delete scene;
+        return nullptr;
+    }
+    return scene;
+}
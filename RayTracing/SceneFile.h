@@ -0,0 +1,42 @@
+#ifndef _SCENEFILE_H_
+#define _SCENEFILE_H_
+
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include "BVH.h"
+
+using namespace std;
+
+class Scene;
+class SceneReader;
+class SceneWriter;
+struct stat;
+
+/* Binary image of a parsed scene, kept next to its XML file as <xml>.bin so that later runs skip parsing the XML.
+It holds the scene as flat arrays: settings, cameras, lights, materials, vertices and shapes, then optionally the BVH
+built over them, followed by the trees of its instanced meshes, so that building it is skipped too. Loading maps the file and copies the arrays out of it in bulk.
+A scene file is only used while it matches the XML file it was written for and the mesh files that one refers to
+(same sizes and modification times), and this build of the renderer (same format version and memory layouts), otherwise it is ignored and written again. */
+class SceneFile
+{
+public:
+    static string getPath(const char * xmlPath);   // Where the scene file of an XML file is kept
+
+    /* Returns the scene of the XML file read from its scene file, nullptr if there is no usable one. The scene has its
+    BVH when the file holds one built with method, otherwise it still needs buildBVH. */
+    static Scene * load(const char * xmlPath, BVH::BuildMethod method);
+
+    /* Writes the scene file of a scene parsed from the XML file, with its BVH if it has one. Returns false if the file
+    cannot be written, e.g. in a read only directory. */
+    static bool save(const Scene & scene, const char * xmlPath);
+
+private:
+    static void putStamp(SceneWriter & writer, const struct stat & xmlStatus);
+    static void putBVH(SceneWriter & writer, const BVH & bvh, const unordered_map<const Shape *, pair<int, int>> & locations);
+    static bool readScene(SceneReader & reader, Scene * scene, BVH::BuildMethod method);
+    static bool readObjects(SceneReader & reader, Scene * scene);
+    static BVH * readBVH(SceneReader & reader, const Scene * scene);
+};
+
+#endif
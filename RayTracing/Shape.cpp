@@ -16,6 +16,11 @@ Shape::Shape(int id, int matIndex)
 {
 }
 
+bool Shape::hasValidMaterial(const Scene & scene) const
+{
+    return this->matIndex >= 1 && this->matIndex <= (int) scene.materials.size();
+}
+
 Sphere::Sphere(void)
 {}
 
@@ -24,31 +29,41 @@ Sphere::Sphere(int id, int matIndex, int cIndex, float R)
     : Shape(id, matIndex)
 {
     this->centerIndex = cIndex;
+    this->radius = R;
     this->radiusSquare = R*R;
 }
 
 /* Sphere-ray intersection routine. You will implement this.
 Note that IntersectionData structure should hold the information related to the intersection point, e.g., coordinate of that point, normal at that point etp3.
 You should to declare the variables in IntersectionData structure you think you will need. It is in defs.h file. */
-IntersectionData Sphere::intersect(const Ray & ray) const
+IntersectionData Sphere::intersect(const Ray & ray, const Scene & scene) const
 {
-    // float a = 1;  d^2
-    float b = dotProduct(ray.direction, ray.origin - pScene->vertices[this->centerIndex-1]); // d.(o-c)
-    float c = dotProduct(ray.origin - pScene->vertices[this->centerIndex-1],
-            ray.origin - pScene->vertices[this->centerIndex-1]) - this->radiusSquare; // (o-c)^2 - R^2
-
-    float discriminant = (b*b) - c;
+    return getRecord(scene).intersect(ray, scene.intTestEps);
+}
 
-    if(discriminant < pScene->intTestEps)
-        return nullIntersect;
+bool Sphere::occluded(const Ray & ray, float tMax, const Scene & scene) const
+{
+    return getRecord(scene).occluded(ray, tMax, scene.intTestEps);
+}
 
-    float t1 = -b - sqrt(discriminant);
-    float t2 = -b + sqrt(discriminant);
+SphereRecord Sphere::getRecord(const Scene & scene) const
+{
+    return {scene.vertices[this->centerIndex-1], this->radiusSquare, matIndex};
+}
 
-    if(t1 < pScene->intTestEps && t2 < pScene->intTestEps)
-        return nullIntersect;
+AABB Sphere::getBounds(const Scene & scene) const
+{
+    Vector3f center = scene.vertices[this->centerIndex-1];
+    Vector3f extent = {this->radius, this->radius, this->radius};
+    AABB bounds;
+    bounds.grow(center - extent);
+    bounds.grow(center + extent);
+    return bounds;
+}
 
-    return {t1, normalize(((ray.origin +  ray.direction * t1) - pScene->vertices[this->centerIndex-1])) , matIndex};
+bool Sphere::hasValidIndices(const Scene & scene) const
+{
+    return hasValidMaterial(scene) && this->centerIndex >= 1 && this->centerIndex <= (int) scene.vertices.size();
 }
 
 Triangle::Triangle(void)
@@ -66,68 +81,143 @@ Triangle::Triangle(int id, int matIndex, int p1Index, int p2Index, int p3Index)
 /* Triangle-ray intersection routine. You will implement this. 
 Note that IntersectionData structure should hold the information related to the intersection point, e.g., coordinate of that point, normal at that point etp3.
 You should to declare the variables in IntersectionData structure you think you will need. It is in defs.h file. */
-IntersectionData Triangle::intersect(const Ray & ray) const
-{
-    Vector3f p1 = pScene->vertices[this->p1index-1];
-    Vector3f p2 = pScene->vertices[this->p2index-1];
-    Vector3f p3 = pScene->vertices[this->p3index-1];
-
-    float det = determinant(
-            p1.x - p2.x, p1.x - p3.x, ray.direction.x,
-            p1.y - p2.y, p1.y - p3.y, ray.direction.y,
-            p1.z - p2.z, p1.z - p3.z, ray.direction.z);
-
-    if(det < pScene->intTestEps && det > -pScene->intTestEps)
-        return nullIntersect;
-
-    float beta = determinant(
-            p1.x - ray.origin.x, p1.x - p3.x, ray.direction.x,
-            p1.y - ray.origin.y, p1.y - p3.y, ray.direction.y,
-            p1.z - ray.origin.z, p1.z - p3.z, ray.direction.z)
-                 / det;
-    float gamma = determinant(
-            p1.x - p2.x, p1.x - ray.origin.x, ray.direction.x,
-            p1.y - p2.y, p1.y - ray.origin.y, ray.direction.y,
-            p1.z - p2.z, p1.z - ray.origin.z, ray.direction.z)
-                 / det;
-    float t = determinant(
-            p1.x - p2.x, p1.x - p3.x, p1.x - ray.origin.x,
-            p1.y - p2.y, p1.y - p3.y, p1.y - ray.origin.y,
-            p1.z - p2.z, p1.z - p3.z, p1.z - ray.origin.z)
-              / det;
-
-    if (t > pScene->intTestEps && beta + gamma <= 1 && 0 <= beta && 0 <= gamma)
-        return {t, normalize(crossProduct(p3-p2, p1-p2)), matIndex};
-
-    return nullIntersect;
+IntersectionData Triangle::intersect(const Ray & ray, const Scene & scene) const
+{
+    return getRecord(scene).intersect(ray, scene.intTestEps);
+}
+
+bool Triangle::occluded(const Ray & ray, float tMax, const Scene & scene) const
+{
+    return getRecord(scene).occluded(ray, tMax, scene.intTestEps);
+}
+
+TriangleRecord Triangle::getRecord(const Scene & scene) const
+{
+    Vector3f p1 = scene.vertices[this->p1index-1];
+    Vector3f p2 = scene.vertices[this->p2index-1];
+    Vector3f p3 = scene.vertices[this->p3index-1];
+
+    return {p1, p2 - p1, p3 - p1, normalize(crossProduct(p3-p2, p1-p2)), matIndex};
+}
+
+AABB Triangle::getBounds(const Scene & scene) const
+{
+    AABB bounds;
+    bounds.grow(scene.vertices[this->p1index-1]);
+    bounds.grow(scene.vertices[this->p2index-1]);
+    bounds.grow(scene.vertices[this->p3index-1]);
+    return bounds;
+}
+
+bool Triangle::hasValidIndices(const Scene & scene) const
+{
+    int vertexCount = scene.vertices.size();
+    return hasValidMaterial(scene) && this->p1index >= 1 && this->p1index <= vertexCount &&
+           this->p2index >= 1 && this->p2index <= vertexCount && this->p3index >= 1 && this->p3index <= vertexCount;
 }
 
 Mesh::Mesh()
+    : prototype(false)
 {}
 
 /* Constructor for mesh. You will implement this. */
-Mesh::Mesh(int id, int matIndex, const vector<Triangle>& faces)
-    : Shape(id, matIndex)
+Mesh::Mesh(int id, int matIndex, vector<Triangle> faces, bool prototype)
+    : Shape(id, matIndex), prototype(prototype)
 {
-    this->triangles = faces;
+    this->triangles = move(faces);
 }
 
 /* Mesh-ray intersection routine. You will implement this. 
 Note that IntersectionData structure should hold the information related to the intersection point, e.g., coordinate of that point, normal at that point etp3.
 You should to declare the variables in IntersectionData structure you think you will need. It is in defs.h file. */
-IntersectionData Mesh::intersect(const Ray & ray) const
+IntersectionData Mesh::intersect(const Ray & ray, const Scene &) const
+{
+    return this->faceRecords.intersect(ray);
+}
+
+bool Mesh::occluded(const Ray & ray, float tMax, const Scene &) const
+{
+    return this->faceRecords.occluded(ray, tMax);
+}
+
+AABB Mesh::getBounds(const Scene & scene) const
+{
+    AABB bounds;
+    for (const Triangle & face : this->triangles)
+        bounds.grow(face.getBounds(scene));
+    return bounds;
+}
+
+bool Mesh::hasValidIndices(const Scene & scene) const
+{
+    for (const Triangle & face : this->triangles) {
+        if (!face.hasValidIndices(scene))
+            return false;
+    }
+    return hasValidMaterial(scene);
+}
+
+const vector<Triangle> & Mesh::getFaces() const
+{
+    return this->triangles;
+}
+
+void Mesh::updateFaces(const Scene & scene)
 {
     int size = this->triangles.size();
-    IntersectionData tempMin = nullIntersect;
-
-    for(int i=0; i < size; i++)
-    {
-        IntersectionData inters = this->triangles[i].intersect(ray);
-        if(inters.t < tempMin.t)
-        {
-            tempMin = inters;
-        }
+    this->faceRecords.resize(size, scene.intTestEps);
+    for (int i = 0; i < size; i++)
+        this->faceRecords.set(i, this->triangles[i].getRecord(scene));
+}
+
+Instance::Instance()
+{}
+
+Instance::Instance(int id, int matIndex, const Mesh * mesh, const Transform & transform, const Transform & inverse)
+    : Shape(id, matIndex), mesh(mesh), transform(transform), inverse(inverse)
+{}
+
+/* The ray is taken to the object space of the mesh without normalizing its direction, so that distances along it
+stay those of the world space ray. */
+IntersectionData Instance::intersect(const Ray & ray, const Scene & scene) const
+{
+    Ray objectRay(this->inverse.transformPoint(ray.origin), this->inverse.transformVector(ray.direction));
+    IntersectionData hit = this->mesh->intersect(objectRay, scene);
+    if (hit.materialId >= 0) {
+        hit.normal = normalize(this->inverse.transposeVector(hit.normal));
+        hit.materialId = this->matIndex;
     }
-    return tempMin;
+    return hit;
+}
 
+bool Instance::occluded(const Ray & ray, float tMax, const Scene & scene) const
+{
+    Ray objectRay(this->inverse.transformPoint(ray.origin), this->inverse.transformVector(ray.direction));
+    return this->mesh->occluded(objectRay, tMax, scene);
+}
+
+AABB Instance::getBounds(const Scene & scene) const
+{
+    return this->transform.transformBounds(this->mesh->getBounds(scene));
+}
+
+// The mesh checks its own faces
+bool Instance::hasValidIndices(const Scene & scene) const
+{
+    return hasValidMaterial(scene);
+}
+
+const Mesh * Instance::getMesh() const
+{
+    return this->mesh;
+}
+
+const Transform & Instance::getTransform() const
+{
+    return this->transform;
+}
+
+const Transform & Instance::getInverse() const
+{
+    return this->inverse;
 }
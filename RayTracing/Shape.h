@@ -3,21 +3,31 @@
 
 #include <vector>
 #include "Ray.h"
+#include "SphereArray.h"
+#include "TriangleArray.h"
 #include "defs.h"
 
 using namespace std;
 
-// Base class for any shape object
+/* Base class for any shape object. Shapes only keep indices into the vertices of the scene they belong to, so every
+method that needs their geometry is given that scene. */
 class Shape
 {
 public: 
 	int id;	        // Id of the shape
 	int matIndex;	// Material index of the shape
 
-	virtual IntersectionData intersect(const Ray & ray) const = 0; // Pure virtual method for intersection test. You must implement this for sphere, triangle, and mesh.
+	virtual IntersectionData intersect(const Ray & ray, const Scene & scene) const = 0; // Pure virtual method for intersection test. You must implement this for sphere, triangle, and mesh.
+	virtual bool occluded(const Ray & ray, float tMax, const Scene & scene) const = 0; // Any hit test for shadow rays: is the shape hit closer than tMax
+	virtual AABB getBounds(const Scene & scene) const = 0; // Returns the world space bounding box of the shape
+	virtual bool hasValidIndices(const Scene & scene) const = 0; // Whether its material and vertices all exist in the scene
 
     Shape(void);
     Shape(int id, int matIndex); // Constructor
+    virtual ~Shape() {}
+
+protected:
+	bool hasValidMaterial(const Scene & scene) const;	// Whether matIndex is one of the scene's materials, which count from 1
 
 private:
 	// Write any other stuff here
@@ -29,11 +39,17 @@ class Sphere: public Shape
 public:
 	Sphere(void);	// Constructor
 	Sphere(int id, int matIndex, int cIndex, float R);	// Constructor
-	IntersectionData intersect(const Ray & ray) const;	// Will take a ray and return a structure related to the intersection information. You will implement this.
+	IntersectionData intersect(const Ray & ray, const Scene & scene) const;	// Will take a ray and return a structure related to the intersection information. You will implement this.
+	bool occluded(const Ray & ray, float tMax, const Scene & scene) const;
+	AABB getBounds(const Scene & scene) const;
+	bool hasValidIndices(const Scene & scene) const;
+	SphereRecord getRecord(const Scene & scene) const; // Record of the sphere for the current position of its center
 
 private:
 	// Write any other stuff here
+	friend class SceneFile;
 	int centerIndex;
+	float radius;
 	float radiusSquare;
 };
 
@@ -43,10 +59,15 @@ class Triangle: public Shape
 public:
 	Triangle(void);	// Constructor
 	Triangle(int id, int matIndex, int p1Index, int p2Index, int p3Index);	// Constructor
-	IntersectionData intersect(const Ray & ray) const; // Will take a ray and return a structure related to the intersection information. You will implement this.
+	IntersectionData intersect(const Ray & ray, const Scene & scene) const; // Will take a ray and return a structure related to the intersection information. You will implement this.
+	bool occluded(const Ray & ray, float tMax, const Scene & scene) const;
+	AABB getBounds(const Scene & scene) const;
+	bool hasValidIndices(const Scene & scene) const;
+	TriangleRecord getRecord(const Scene & scene) const; // Record of the triangle for the current positions of its vertices
 
 private:
 	// Write any other stuff here
+	friend class SceneFile;
 	int p1index;
 	int p2index;
 	int p3index;
@@ -56,13 +77,45 @@ private:
 class Mesh: public Shape
 {
 public:
+	bool prototype;	// Only placed by its instances, left out of the scene's acceleration structure and not rendered where it is
+
 	Mesh(void);	// Constructor
-	Mesh(int id, int matIndex, const vector<Triangle>& faces);	// Constructor
-	IntersectionData intersect(const Ray & ray) const; // Will take a ray and return a structure related to the intersection information. You will implement this.
+	Mesh(int id, int matIndex, vector<Triangle> faces, bool prototype = false);	// Constructor, moving the faces in avoids copying large meshes
+	IntersectionData intersect(const Ray & ray, const Scene & scene) const; // Will take a ray and return a structure related to the intersection information. You will implement this.
+	bool occluded(const Ray & ray, float tMax, const Scene & scene) const;
+	AABB getBounds(const Scene & scene) const;
+	bool hasValidIndices(const Scene & scene) const;
+	const vector<Triangle> & getFaces() const; // Faces of the mesh, flattened into the scene's acceleration structure
+	void updateFaces(const Scene & scene); // Recomputes the face records from the scene's vertices, needed before intersect or occluded
 
 private:
 	// Write any other stuff here
+	friend class SceneFile;
 	vector<Triangle> triangles;
+	TriangleArray faceRecords;	// Records of the triangles for brute force tests, filled by updateFaces
+};
+
+/* Class for instances: a mesh placed once more in the scene through a transform, without copying its vertices or
+faces. The acceleration structure builds one tree over the faces of an instanced mesh, shared by all its instances,
+and tests rays against it in the object space of each instance. */
+class Instance: public Shape
+{
+public:
+	Instance(void);	// Constructor
+	Instance(int id, int matIndex, const Mesh * mesh, const Transform & transform, const Transform & inverse);	// Constructor, inverse is the inverse of transform
+	IntersectionData intersect(const Ray & ray, const Scene & scene) const;
+	bool occluded(const Ray & ray, float tMax, const Scene & scene) const;
+	AABB getBounds(const Scene & scene) const;
+	bool hasValidIndices(const Scene & scene) const;
+	const Mesh * getMesh() const;
+	const Transform & getTransform() const;	// Object to world space
+	const Transform & getInverse() const;	// World to object space
+
+private:
+	friend class SceneFile;
+	const Mesh * mesh;
+	Transform transform;
+	Transform inverse;
 };
 
 #endif
@@ -0,0 +1,145 @@
+#include "SphereArray.h"
+#include "helpers.h"
+#include <limits>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+const float INF = numeric_limits<float>::max();
+
+#define nullIntersect {INF,{},-1}
+
+/* Solves |o + t*d - c|^2 = R^2 for the unit direction d. With b = d.(o-c) and c' = (o-c)^2 - R^2 the roots are
+-b -+ sqrt(b^2 - c'). The ray misses if the discriminant is below intTestEps or if both roots are, and the
+near root is returned otherwise, even when it is behind the origin because the ray starts inside the sphere.
+The far root is only compared, so the square root is taken once. */
+IntersectionData SphereRecord::intersect(const Ray & ray, float intTestEps) const
+{
+    Vector3f centerToOrigin = ray.origin - this->center;
+    float b = dotProduct(ray.direction, centerToOrigin);
+    float c = dotProduct(centerToOrigin, centerToOrigin) - this->radiusSquare;
+
+    float discriminant = (b*b) - c;
+
+    if(discriminant < intTestEps)
+        return nullIntersect;
+
+    float root = sqrt(discriminant);
+    float t1 = -b - root;
+    float t2 = -b + root;
+
+    if(t1 < intTestEps && t2 < intTestEps)
+        return nullIntersect;
+
+    return {t1, normalize((ray.origin + ray.direction * t1) - this->center), this->materialId};
+}
+
+bool SphereRecord::occluded(const Ray & ray, float tMax, float intTestEps) const
+{
+    Vector3f centerToOrigin = ray.origin - this->center;
+    float b = dotProduct(ray.direction, centerToOrigin);
+    float c = dotProduct(centerToOrigin, centerToOrigin) - this->radiusSquare;
+
+    float discriminant = (b*b) - c;
+
+    if(discriminant < intTestEps)
+        return false;
+
+    float root = sqrt(discriminant);
+    float t1 = -b - root;
+    float t2 = -b + root;
+
+    if(t1 < intTestEps && t2 < intTestEps)
+        return false;
+
+    return t1 < tMax;
+}
+
+void SphereArray::resize(int count, float intTestEps)
+{
+    this->intTestEps = intTestEps;
+    // Padding slots have a radius of -infinity squared, their discriminant is -infinity for every ray
+    for (int axis = 0; axis < 3; ++axis)
+        center[axis].assign(count + SPHERE_BLOCK_WIDTH, 0.0f);
+    radiusSquare.assign(count + SPHERE_BLOCK_WIDTH, -INFINITY);
+    materialIds.assign(count, 0);
+}
+
+void SphereArray::set(int index, const SphereRecord & record)
+{
+    center[0][index] = record.center.x;
+    center[1][index] = record.center.y;
+    center[2][index] = record.center.z;
+    radiusSquare[index] = record.radiusSquare;
+    materialIds[index] = record.materialId;
+}
+
+int SphereArray::size() const
+{
+    return materialIds.size();
+}
+
+IntersectionData SphereArray::getIntersection(int index, const Ray & ray, float t) const
+{
+    Vector3f sphereCenter = {center[0][index], center[1][index], center[2][index]};
+    return {t, normalize((ray.origin + ray.direction * t) - sphereCenter), materialIds[index]};
+}
+
+/* Same computation as SphereRecord::intersect, one sphere per lane. A lane is hit when its discriminant is at
+least intTestEps and its far root is (both roots are below intTestEps exactly when the far one is). */
+int SphereArray::intersectBlock(const Ray & ray, int first, float * t) const
+{
+    float eps = intTestEps;
+
+#if defined(__AVX2__)
+    __m256 dx = _mm256_set1_ps(ray.direction.x), dy = _mm256_set1_ps(ray.direction.y), dz = _mm256_set1_ps(ray.direction.z);
+    __m256 ox = _mm256_sub_ps(_mm256_set1_ps(ray.origin.x), _mm256_loadu_ps(&center[0][first]));
+    __m256 oy = _mm256_sub_ps(_mm256_set1_ps(ray.origin.y), _mm256_loadu_ps(&center[1][first]));
+    __m256 oz = _mm256_sub_ps(_mm256_set1_ps(ray.origin.z), _mm256_loadu_ps(&center[2][first]));
+
+    __m256 b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, ox), _mm256_mul_ps(dy, oy)), _mm256_mul_ps(dz, oz));
+    __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ox, ox), _mm256_mul_ps(oy, oy)),
+            _mm256_mul_ps(oz, oz)), _mm256_loadu_ps(&radiusSquare[first]));
+    __m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(b, b), c);
+    __m256 epsilon = _mm256_set1_ps(eps);
+    __m256 hit = _mm256_cmp_ps(discriminant, epsilon, _CMP_GE_OQ);
+
+    __m256 root = _mm256_sqrt_ps(discriminant);
+    __m256 minusB = _mm256_sub_ps(_mm256_setzero_ps(), b);
+    __m256 t1 = _mm256_sub_ps(minusB, root);
+    __m256 t2 = _mm256_add_ps(minusB, root);
+    hit = _mm256_and_ps(hit, _mm256_cmp_ps(t2, epsilon, _CMP_GE_OQ));
+    _mm256_storeu_ps(t, t1);
+    return _mm256_movemask_ps(hit);
+#elif defined(__SSE2__)
+    __m128 dx = _mm_set1_ps(ray.direction.x), dy = _mm_set1_ps(ray.direction.y), dz = _mm_set1_ps(ray.direction.z);
+    __m128 ox = _mm_sub_ps(_mm_set1_ps(ray.origin.x), _mm_loadu_ps(&center[0][first]));
+    __m128 oy = _mm_sub_ps(_mm_set1_ps(ray.origin.y), _mm_loadu_ps(&center[1][first]));
+    __m128 oz = _mm_sub_ps(_mm_set1_ps(ray.origin.z), _mm_loadu_ps(&center[2][first]));
+
+    __m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, ox), _mm_mul_ps(dy, oy)), _mm_mul_ps(dz, oz));
+    __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ox, ox), _mm_mul_ps(oy, oy)), _mm_mul_ps(oz, oz)),
+            _mm_loadu_ps(&radiusSquare[first]));
+    __m128 discriminant = _mm_sub_ps(_mm_mul_ps(b, b), c);
+    __m128 epsilon = _mm_set1_ps(eps);
+    __m128 hit = _mm_cmpge_ps(discriminant, epsilon);
+
+    __m128 root = _mm_sqrt_ps(discriminant);
+    __m128 minusB = _mm_sub_ps(_mm_setzero_ps(), b);
+    __m128 t1 = _mm_sub_ps(minusB, root);
+    __m128 t2 = _mm_add_ps(minusB, root);
+    hit = _mm_and_ps(hit, _mm_cmpge_ps(t2, epsilon));
+    _mm_storeu_ps(t, t1);
+    return _mm_movemask_ps(hit);
+#else
+    int hitMask = 0;
+    for (int i = 0; i < SPHERE_BLOCK_WIDTH; ++i) {
+        SphereRecord record = {{center[0][first + i], center[1][first + i], center[2][first + i]},
+                               radiusSquare[first + i], 0};
+        t[i] = record.intersect(ray, eps).t;
+        if (t[i] != INF)
+            hitMask |= 1 << i;
+    }
+    return hitMask;
+#endif
+}
@@ -0,0 +1,53 @@
+#ifndef _SPHEREARRAY_H_
+#define _SPHEREARRAY_H_
+
+#include <vector>
+#include "Ray.h"
+#include "defs.h"
+
+using namespace std;
+
+// Number of spheres a ray is tested against at once, matches the widest SIMD registers available
+#if defined(__AVX2__)
+#define SPHERE_BLOCK_WIDTH 8
+#else
+#define SPHERE_BLOCK_WIDTH 4
+#endif
+
+/* Sphere prepared for intersection tests: its center read once from the scene's vertices and its squared radius. */
+typedef struct SphereRecord
+{
+    Vector3f center;
+    float radiusSquare;
+    int materialId;
+
+    IntersectionData intersect(const Ray & ray, float intTestEps) const;
+    bool occluded(const Ray & ray, float tMax, float intTestEps) const;
+} SphereRecord;
+
+/* Sphere records laid out as a structure of arrays, one array per coordinate of the center and one for the squared
+radius, so that SPHERE_BLOCK_WIDTH consecutive spheres are loaded into SIMD registers and tested against a ray at
+once. Same conventions as TriangleArray: any index can start a block, padding is never hit, and materials are
+only read for hits. */
+class SphereArray
+{
+public:
+    void resize(int count, float intTestEps);  // Hits are then tested with the scene's intTestEps
+    void set(int index, const SphereRecord & record);
+    int size() const;
+
+    IntersectionData getIntersection(int index, const Ray & ray, float t) const; // Computes the normal for a hit
+
+    /* Tests the ray against the SPHERE_BLOCK_WIDTH spheres starting at first. Returns a bit mask of the spheres
+    hit and writes the distances of their near intersections to t. */
+    int intersectBlock(const Ray & ray, int first, float * t) const;
+
+private:
+    friend class SceneFile;
+    vector<float> center[3];    // [axis][sphere]
+    vector<float> radiusSquare;
+    vector<int> materialIds;
+    float intTestEps;
+};
+
+#endif
@@ -0,0 +1,56 @@
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(int numThreads) : job(nullptr), generation(0), running(0), stopping(false)
+{
+    for (int i = 0; i < numThreads; ++i)
+        threads.push_back(thread(&ThreadPool::work, this, i));
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        lock_guard<mutex> guard(jobMutex);
+        stopping = true;
+    }
+    jobReady.notify_all();
+    for (thread & worker : threads)
+        worker.join();
+}
+
+int ThreadPool::size() const
+{
+    return threads.size();
+}
+
+void ThreadPool::run(const function<void(int)> & job)
+{
+    unique_lock<mutex> lock(jobMutex);
+    this->job = &job;
+    running = threads.size();
+    ++generation;
+    jobReady.notify_all();
+    jobDone.wait(lock, [this] { return running == 0; });
+    this->job = nullptr;
+}
+
+void ThreadPool::work(int worker)
+{
+    unsigned long done = 0;
+    while (true) {
+        const function<void(int)> * current;
+        {
+            unique_lock<mutex> lock(jobMutex);
+            jobReady.wait(lock, [this, done] { return stopping || generation != done; });
+            if (stopping)
+                return;
+            done = generation;
+            current = job;
+        }
+
+        (*current)(worker);
+
+        lock_guard<mutex> guard(jobMutex);
+        if (--running == 0)
+            jobDone.notify_one();
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef _THREADPOOL_H_
+#define _THREADPOOL_H_
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+/* Fixed set of worker threads that live as long as the pool, so that rendering several cameras or several frames
+does not create and join threads every time. A job runs on every worker at once and is given the index of the
+worker, the workers then share its tasks through their own means, e.g. a TileScheduler. */
+class ThreadPool
+{
+public:
+    explicit ThreadPool(int numThreads);
+    ~ThreadPool();  // Waits for the workers to finish the current job and stops them
+
+    int size() const;   // Number of workers
+    void run(const function<void(int)> & job);  // Calls job(worker) on every worker and returns once all returned, one job at a time
+
+private:
+    vector<thread> threads;
+    mutex jobMutex;
+    condition_variable jobReady;    // Signalled when a job is posted or the pool stops
+    condition_variable jobDone;     // Signalled when the last worker finished the job
+    const function<void(int)> * job;
+    unsigned long generation;       // Number of jobs posted so far, tells workers a new job is there
+    int running;                    // Workers still running the current job
+    bool stopping;
+
+    void work(int worker);
+};
+
+#endif
@@ -0,0 +1,109 @@
+#include "TileScheduler.h"
+#include <algorithm>
+
+static inline uint64_t packRange(uint32_t begin, uint32_t end) {
+    return (uint64_t) end << 32 | begin;
+}
+
+static inline uint32_t rangeBegin(uint64_t range) {
+    return (uint32_t) range;
+}
+
+static inline uint32_t rangeEnd(uint64_t range) {
+    return (uint32_t) (range >> 32);
+}
+
+// Interleaves the bits of the tile coordinates, x in the even bits and y in the odd ones
+static uint32_t mortonCode(uint32_t x, uint32_t y) {
+    uint32_t code = 0;
+    for (int bit = 0; bit < 16; ++bit)
+        code |= ((x >> bit) & 1) << (2 * bit) | ((y >> bit) & 1) << (2 * bit + 1);
+    return code;
+}
+
+TileScheduler::TileScheduler(const vector<pair<int, int>> & imageSizes, int numWorkers) : ranges(max(numWorkers, 1))
+{
+    vector<vector<Tile>> shares(ranges.size());
+    for (int image = 0; image < (int) imageSizes.size(); ++image) {
+        int nx = imageSizes[image].first, ny = imageSizes[image].second;
+        vector<pair<uint32_t, Tile>> ordered;
+        for (int firstRow = 0; firstRow < ny; firstRow += tileSize) {
+            for (int firstCol = 0; firstCol < nx; firstCol += tileSize) {
+                Tile tile = {image, firstRow, min(firstRow + tileSize, ny), firstCol, min(firstCol + tileSize, nx)};
+                ordered.push_back({mortonCode(firstCol / tileSize, firstRow / tileSize), tile});
+            }
+        }
+        // Codes are unique, the tiles of images that are not square powers of two simply leave gaps in the curve
+        sort(ordered.begin(), ordered.end(),
+             [](const pair<uint32_t, Tile> & a, const pair<uint32_t, Tile> & b) { return a.first < b.first; });
+
+        // Equal contiguous parts of the curve, so each worker starts on its own part of the image
+        int numTiles = ordered.size();
+        int numShares = shares.size();
+        for (int i = 0; i < numShares; ++i) {
+            for (int k = numTiles * i / numShares; k < numTiles * (i + 1) / numShares; ++k)
+                shares[i].push_back(ordered[k].second);
+        }
+        tileCounts.push_back(numTiles);
+    }
+
+    for (int i = 0; i < (int) shares.size(); ++i) {
+        uint32_t begin = tiles.size();
+        tiles.insert(tiles.end(), shares[i].begin(), shares[i].end());
+        ranges[i].bounds.store(packRange(begin, tiles.size()));
+    }
+}
+
+bool TileScheduler::next(int worker, Tile & tile)
+{
+    atomic<uint64_t> & own = ranges[worker].bounds;
+    while (true) {
+        uint64_t range = own.load();
+        while (rangeBegin(range) < rangeEnd(range)) {
+            if (own.compare_exchange_weak(range, packRange(rangeBegin(range) + 1, rangeEnd(range)))) {
+                tile = tiles[rangeBegin(range)];
+                return true;
+            }
+            // range was reloaded by the failed exchange, a thief took the back of it
+        }
+        if (!steal(worker))
+            return false;
+    }
+}
+
+int TileScheduler::getTileCount(int image) const
+{
+    return tileCounts[image];
+}
+
+/* Moves the back half of the largest range of the other workers to the worker's own range, which is empty. Returns
+false when every range is empty. Tiles only ever leave a range, so a worker that finds everything empty while
+another one is moving stolen tiles can stop, those tiles are rendered by the thief. */
+bool TileScheduler::steal(int worker)
+{
+    while (true) {
+        int victim = -1;
+        uint32_t largest = 0;
+        uint64_t victimRange = 0;
+        for (int offset = 1; offset < (int) ranges.size(); ++offset) {
+            int candidate = (worker + offset) % ranges.size();
+            uint64_t range = ranges[candidate].bounds.load();
+            if (rangeBegin(range) < rangeEnd(range) && rangeEnd(range) - rangeBegin(range) > largest) {
+                victim = candidate;
+                largest = rangeEnd(range) - rangeBegin(range);
+                victimRange = range;
+            }
+        }
+        if (victim < 0)
+            return false;
+
+        uint32_t begin = rangeBegin(victimRange), end = rangeEnd(victimRange);
+        uint32_t middle = begin + (end - begin) / 2;
+        if (ranges[victim].bounds.compare_exchange_strong(victimRange, packRange(begin, middle))) {
+            // Nobody steals from an empty range, so the worker's own range can simply be overwritten
+            ranges[worker].bounds.store(packRange(middle, end));
+            return true;
+        }
+        // The victim or another thief changed the range meanwhile, look again
+    }
+}
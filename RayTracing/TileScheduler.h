@@ -0,0 +1,54 @@
+#ifndef _TILESCHEDULER_H_
+#define _TILESCHEDULER_H_
+
+#include <atomic>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+// Rectangle of pixels rendered as one task, rows [firstRow, endRow) and columns [firstCol, endCol) of an image
+typedef struct Tile
+{
+    int image;  // Index of the image in the list the scheduler was given
+    int firstRow;
+    int endRow;
+    int firstCol;
+    int endCol;
+} Tile;
+
+/* Hands out the tiles of a set of images to a fixed number of workers without locks. Each image is split into
+tileSize x tileSize tiles ordered along a Morton curve, so that consecutive tiles are neighbours on the image.
+Every worker starts with a contiguous range made of an equal share of each image in turn, so all workers render the
+first image together and it is finished early, then move on to the next. A worker takes tiles from the front of its
+own range. Once its range is empty it steals the back half of the largest range left, so the tiles that turn out to be
+expensive, e.g. those covering mirrors, are spread over every worker. Each range is a single atomic word that
+both its owner and thieves update with compare and swap, so a tile is claimed exactly once. */
+class TileScheduler
+{
+public:
+    static const int tileSize = 16; // A multiple of every packet size, packets never straddle tiles
+
+    TileScheduler(const vector<pair<int, int>> & imageSizes, int numWorkers); // Width and height of each image
+
+    bool next(int worker, Tile & tile); // Claims a tile for the worker, false once every tile is claimed
+    int getTileCount(int image) const;
+
+private:
+    // Range [begin, end) of the tile order that a worker owns, begin in the low half of the word. Padded to a
+    // cache line so that workers claiming tiles do not slow each other down.
+    typedef struct Range
+    {
+        atomic<uint64_t> bounds;
+        char padding[64 - sizeof(atomic<uint64_t>)];
+    } Range;
+
+    vector<Tile> tiles;     // Shares of the workers one after the other, Morton order within each image
+    vector<Range> ranges;   // One per worker
+    vector<int> tileCounts; // Per image
+
+    bool steal(int worker);
+};
+
+#endif
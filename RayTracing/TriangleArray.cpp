@@ -0,0 +1,232 @@
+#include "TriangleArray.h"
+#include "helpers.h"
+#include <algorithm>
+#include <limits>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+const float INF = numeric_limits<float>::max();
+
+#define nullIntersect {INF,{},-1}
+
+/* Moller-Trumbore: the barycentric coordinates (beta, gamma) and t are solved with two cross products,
+and the test gives up as soon as one of them is out of range. det is the same determinant Cramer's rule
+would divide by (up to sign), so the same rays are rejected as parallel to the triangle. */
+IntersectionData TriangleRecord::intersect(const Ray & ray, float intTestEps) const
+{
+    Vector3f pVec = crossProduct(ray.direction, this->edge2);
+    float det = dotProduct(this->edge1, pVec);
+
+    if(det < intTestEps && det > -intTestEps)
+        return nullIntersect;
+
+    float invDet = 1.0f / det;
+    Vector3f tVec = ray.origin - this->vertex;
+    float beta = dotProduct(tVec, pVec) * invDet;
+    if (beta < 0 || beta > 1)
+        return nullIntersect;
+
+    Vector3f qVec = crossProduct(tVec, this->edge1);
+    float gamma = dotProduct(ray.direction, qVec) * invDet;
+    if (gamma < 0 || beta + gamma > 1)
+        return nullIntersect;
+
+    float t = dotProduct(this->edge2, qVec) * invDet;
+    if (t > intTestEps)
+        return {t, this->normal, this->materialId};
+
+    return nullIntersect;
+}
+
+bool TriangleRecord::occluded(const Ray & ray, float tMax, float intTestEps) const
+{
+    Vector3f pVec = crossProduct(ray.direction, this->edge2);
+    float det = dotProduct(this->edge1, pVec);
+
+    if(det < intTestEps && det > -intTestEps)
+        return false;
+
+    float invDet = 1.0f / det;
+    Vector3f tVec = ray.origin - this->vertex;
+    float beta = dotProduct(tVec, pVec) * invDet;
+    if (beta < 0 || beta > 1)
+        return false;
+
+    Vector3f qVec = crossProduct(tVec, this->edge1);
+    float gamma = dotProduct(ray.direction, qVec) * invDet;
+    if (gamma < 0 || beta + gamma > 1)
+        return false;
+
+    float t = dotProduct(this->edge2, qVec) * invDet;
+    return t > intTestEps && t < tMax;
+}
+
+void TriangleArray::resize(int count, float intTestEps)
+{
+    this->intTestEps = intTestEps;
+    // Padding slots have zero edges, their determinant is zero and they are rejected as parallel to every ray
+    for (int axis = 0; axis < 3; ++axis) {
+        vertex[axis].assign(count + TRIANGLE_BLOCK_WIDTH, 0.0f);
+        edge1[axis].assign(count + TRIANGLE_BLOCK_WIDTH, 0.0f);
+        edge2[axis].assign(count + TRIANGLE_BLOCK_WIDTH, 0.0f);
+    }
+    normals.assign(count, Vector3f());
+    materialIds.assign(count, 0);
+}
+
+void TriangleArray::set(int index, const TriangleRecord & record)
+{
+    vertex[0][index] = record.vertex.x;
+    vertex[1][index] = record.vertex.y;
+    vertex[2][index] = record.vertex.z;
+    edge1[0][index] = record.edge1.x;
+    edge1[1][index] = record.edge1.y;
+    edge1[2][index] = record.edge1.z;
+    edge2[0][index] = record.edge2.x;
+    edge2[1][index] = record.edge2.y;
+    edge2[2][index] = record.edge2.z;
+    normals[index] = record.normal;
+    materialIds[index] = record.materialId;
+}
+
+int TriangleArray::size() const
+{
+    return materialIds.size();
+}
+
+IntersectionData TriangleArray::getIntersection(int index, float t) const
+{
+    return {t, normals[index], materialIds[index]};
+}
+
+/* Same computation as TriangleRecord::intersect, one triangle per lane. Instead of returning early, the lanes
+that fail a test are masked out, and the mask of the lanes left at the end is returned. */
+int TriangleArray::intersectBlock(const Ray & ray, int first, float * t) const
+{
+    float eps = intTestEps;
+
+#if defined(__AVX2__)
+    __m256 dx = _mm256_set1_ps(ray.direction.x), dy = _mm256_set1_ps(ray.direction.y), dz = _mm256_set1_ps(ray.direction.z);
+    __m256 e1x = _mm256_loadu_ps(&edge1[0][first]), e1y = _mm256_loadu_ps(&edge1[1][first]), e1z = _mm256_loadu_ps(&edge1[2][first]);
+    __m256 e2x = _mm256_loadu_ps(&edge2[0][first]), e2y = _mm256_loadu_ps(&edge2[1][first]), e2z = _mm256_loadu_ps(&edge2[2][first]);
+
+    // pVec = direction x edge2, det = edge1 . pVec
+    __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+    __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+    __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+    __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+    __m256 epsilon = _mm256_set1_ps(eps);
+    __m256 hit = _mm256_or_ps(_mm256_cmp_ps(det, epsilon, _CMP_GE_OQ),
+            _mm256_cmp_ps(det, _mm256_sub_ps(_mm256_setzero_ps(), epsilon), _CMP_LE_OQ));
+    __m256 invDet = _mm256_div_ps(_mm256_set1_ps(1.0f), det);
+
+    // tVec = origin - vertex, beta = tVec . pVec / det
+    __m256 tx = _mm256_sub_ps(_mm256_set1_ps(ray.origin.x), _mm256_loadu_ps(&vertex[0][first]));
+    __m256 ty = _mm256_sub_ps(_mm256_set1_ps(ray.origin.y), _mm256_loadu_ps(&vertex[1][first]));
+    __m256 tz = _mm256_sub_ps(_mm256_set1_ps(ray.origin.z), _mm256_loadu_ps(&vertex[2][first]));
+    __m256 beta = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)),
+            _mm256_mul_ps(tz, pz)), invDet);
+
+    // qVec = tVec x edge1, gamma = direction . qVec / det, t = edge2 . qVec / det
+    __m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(tz, e1y));
+    __m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(tx, e1z));
+    __m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(ty, e1x));
+    __m256 gamma = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)),
+            _mm256_mul_ps(dz, qz)), invDet);
+    __m256 dist = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)),
+            _mm256_mul_ps(e2z, qz)), invDet);
+
+    __m256 zero = _mm256_setzero_ps();
+    __m256 one = _mm256_set1_ps(1.0f);
+    hit = _mm256_and_ps(hit, _mm256_cmp_ps(beta, zero, _CMP_GE_OQ));
+    hit = _mm256_and_ps(hit, _mm256_cmp_ps(beta, one, _CMP_LE_OQ));
+    hit = _mm256_and_ps(hit, _mm256_cmp_ps(gamma, zero, _CMP_GE_OQ));
+    hit = _mm256_and_ps(hit, _mm256_cmp_ps(_mm256_add_ps(beta, gamma), one, _CMP_LE_OQ));
+    hit = _mm256_and_ps(hit, _mm256_cmp_ps(dist, epsilon, _CMP_GT_OQ));
+    _mm256_storeu_ps(t, dist);
+    return _mm256_movemask_ps(hit);
+#elif defined(__SSE2__)
+    __m128 dx = _mm_set1_ps(ray.direction.x), dy = _mm_set1_ps(ray.direction.y), dz = _mm_set1_ps(ray.direction.z);
+    __m128 e1x = _mm_loadu_ps(&edge1[0][first]), e1y = _mm_loadu_ps(&edge1[1][first]), e1z = _mm_loadu_ps(&edge1[2][first]);
+    __m128 e2x = _mm_loadu_ps(&edge2[0][first]), e2y = _mm_loadu_ps(&edge2[1][first]), e2z = _mm_loadu_ps(&edge2[2][first]);
+
+    __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+    __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+    __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+    __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+    __m128 epsilon = _mm_set1_ps(eps);
+    __m128 hit = _mm_or_ps(_mm_cmpge_ps(det, epsilon), _mm_cmple_ps(det, _mm_sub_ps(_mm_setzero_ps(), epsilon)));
+    __m128 invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+    __m128 tx = _mm_sub_ps(_mm_set1_ps(ray.origin.x), _mm_loadu_ps(&vertex[0][first]));
+    __m128 ty = _mm_sub_ps(_mm_set1_ps(ray.origin.y), _mm_loadu_ps(&vertex[1][first]));
+    __m128 tz = _mm_sub_ps(_mm_set1_ps(ray.origin.z), _mm_loadu_ps(&vertex[2][first]));
+    __m128 beta = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), invDet);
+
+    __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+    __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+    __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+    __m128 gamma = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), invDet);
+    __m128 dist = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+
+    __m128 zero = _mm_setzero_ps();
+    __m128 one = _mm_set1_ps(1.0f);
+    hit = _mm_and_ps(hit, _mm_cmpge_ps(beta, zero));
+    hit = _mm_and_ps(hit, _mm_cmple_ps(beta, one));
+    hit = _mm_and_ps(hit, _mm_cmpge_ps(gamma, zero));
+    hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_add_ps(beta, gamma), one));
+    hit = _mm_and_ps(hit, _mm_cmpgt_ps(dist, epsilon));
+    _mm_storeu_ps(t, dist);
+    return _mm_movemask_ps(hit);
+#else
+    int hitMask = 0;
+    for (int i = 0; i < TRIANGLE_BLOCK_WIDTH; ++i) {
+        TriangleRecord record = {{vertex[0][first + i], vertex[1][first + i], vertex[2][first + i]},
+                                 {edge1[0][first + i], edge1[1][first + i], edge1[2][first + i]},
+                                 {edge2[0][first + i], edge2[1][first + i], edge2[2][first + i]},
+                                 {}, 0};
+        t[i] = record.intersect(ray, eps).t;
+        if (t[i] != INF)
+            hitMask |= 1 << i;
+    }
+    return hitMask;
+#endif
+}
+
+IntersectionData TriangleArray::intersect(const Ray & ray) const
+{
+    float nearestT = INF;
+    int nearest = -1;
+    int count = size();
+
+    for (int first = 0; first < count; first += TRIANGLE_BLOCK_WIDTH) {
+        float t[TRIANGLE_BLOCK_WIDTH];
+        int hitMask = intersectBlock(ray, first, t) & ((1 << min(TRIANGLE_BLOCK_WIDTH, count - first)) - 1);
+        for (int i = 0; hitMask; ++i, hitMask >>= 1) {
+            if ((hitMask & 1) && t[i] < nearestT) {
+                nearestT = t[i];
+                nearest = first + i;
+            }
+        }
+    }
+    // The hit record is only filled for the nearest triangle
+    if (nearest < 0)
+        return nullIntersect;
+    return getIntersection(nearest, nearestT);
+}
+
+bool TriangleArray::occluded(const Ray & ray, float tMax) const
+{
+    int count = size();
+
+    for (int first = 0; first < count; first += TRIANGLE_BLOCK_WIDTH) {
+        float t[TRIANGLE_BLOCK_WIDTH];
+        int hitMask = intersectBlock(ray, first, t) & ((1 << min(TRIANGLE_BLOCK_WIDTH, count - first)) - 1);
+        for (int i = 0; hitMask; ++i, hitMask >>= 1) {
+            if ((hitMask & 1) && t[i] < tMax)
+                return true;
+        }
+    }
+    return false;
+}
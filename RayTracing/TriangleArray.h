@@ -0,0 +1,62 @@
+#ifndef _TRIANGLEARRAY_H_
+#define _TRIANGLEARRAY_H_
+
+#include <vector>
+#include "Ray.h"
+#include "defs.h"
+
+using namespace std;
+
+// Number of triangles a ray is tested against at once, matches the widest SIMD registers available
+#if defined(__AVX2__)
+#define TRIANGLE_BLOCK_WIDTH 8
+#else
+#define TRIANGLE_BLOCK_WIDTH 4
+#endif
+
+/* Triangle prepared for intersection tests: its first vertex, the two edges leaving that vertex and its normal,
+computed once from the scene's vertices so that a test reads a single contiguous record. */
+typedef struct TriangleRecord
+{
+    Vector3f vertex;    // p1
+    Vector3f edge1;     // p2 - p1
+    Vector3f edge2;     // p3 - p1
+    Vector3f normal;
+    int materialId;
+
+    IntersectionData intersect(const Ray & ray, float intTestEps) const; // Moller-Trumbore test
+    bool occluded(const Ray & ray, float tMax, float intTestEps) const;
+} TriangleRecord;
+
+/* Triangle records laid out as a structure of arrays, one array per coordinate of the first vertex and of the
+two edges, so that TRIANGLE_BLOCK_WIDTH consecutive triangles are loaded into SIMD registers and tested against
+a ray with a single Moller-Trumbore instruction stream. Any index can start a block, the arrays are padded so
+that a block may run past the last triangle. Padding has zero edges and is never hit. Normals and materials are
+only read for hits and are kept aside. */
+class TriangleArray
+{
+public:
+    void resize(int count, float intTestEps);  // Hits are then tested with the scene's intTestEps
+    void set(int index, const TriangleRecord & record);
+    int size() const;
+
+    IntersectionData getIntersection(int index, float t) const;
+
+    /* Tests the ray against the TRIANGLE_BLOCK_WIDTH triangles starting at first. Returns a bit mask of the
+    triangles hit at a distance greater than intTestEps and writes their distances to t. */
+    int intersectBlock(const Ray & ray, int first, float * t) const;
+
+    IntersectionData intersect(const Ray & ray) const; // Nearest hit over every triangle, first one wins ties
+    bool occluded(const Ray & ray, float tMax) const;  // Whether any triangle is hit closer than tMax
+
+private:
+    friend class SceneFile;
+    vector<float> vertex[3];    // [axis][triangle]
+    vector<float> edge1[3];
+    vector<float> edge2[3];
+    vector<Vector3f> normals;
+    vector<int> materialIds;
+    float intTestEps;
+};
+
+#endif
@@ -44,13 +44,6 @@ typedef struct Vector3f
 		return {x/a, y/a, z/a};
     }
 
-	inline Vector3f& operator=(Vector3f a) {
-		x = a.x;
-		y = a.y;
-		z = a.z;
-		return *this;
-    }
-
     inline Vector3f& operator+=(Vector3f a) {
         x += a.x;
         y += a.y;
@@ -94,10 +87,83 @@ typedef struct IntersectionData
 
 } IntersectionData;
 
+/* Axis aligned bounding box. Used by the acceleration structure to bound shapes and groups of shapes.
+A default constructed box is empty (min > max) so that growing it with anything gives that thing's bounds. */
+typedef struct AABB
+{
+    Vector3f min = {INFINITY, INFINITY, INFINITY};
+    Vector3f max = {-INFINITY, -INFINITY, -INFINITY};
+
+    inline void grow(const Vector3f & p) {
+        min = {p.x < min.x ? p.x : min.x, p.y < min.y ? p.y : min.y, p.z < min.z ? p.z : min.z};
+        max = {p.x > max.x ? p.x : max.x, p.y > max.y ? p.y : max.y, p.z > max.z ? p.z : max.z};
+    }
+
+    inline void grow(const AABB & box) {
+        min = {box.min.x < min.x ? box.min.x : min.x, box.min.y < min.y ? box.min.y : min.y,
+               box.min.z < min.z ? box.min.z : min.z};
+        max = {box.max.x > max.x ? box.max.x : max.x, box.max.y > max.y ? box.max.y : max.y,
+               box.max.z > max.z ? box.max.z : max.z};
+    }
+
+    inline Vector3f center() const {
+        return (min + max) * 0.5f;
+    }
+
+    inline float surfaceArea() const {
+        if (min.x > max.x)
+            return 0.0f; // empty box
+        Vector3f extent = max - min;
+        return 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+    }
+} AABB;
+
+/* Affine transform, the first three rows of a 4x4 matrix whose last row is 0 0 0 1: a linear part m[row][0..2] and
+a translation m[row][3]. Points are transformed with the translation, directions without it. */
+typedef struct Transform
+{
+    float m[3][4];
+
+    inline Vector3f transformPoint(const Vector3f & p) const {
+        return {m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+                m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+                m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3]};
+    }
+
+    inline Vector3f transformVector(const Vector3f & v) const {
+        return {m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+                m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+                m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z};
+    }
 
-//
-// The global variable through which you can access the scene data
-//
-extern Scene* pScene;
+    // Multiplies by the transpose of the linear part. Called on the inverse of a transform, this carries normals
+    // through that transform, up to their length.
+    inline Vector3f transposeVector(const Vector3f & v) const {
+        return {m[0][0] * v.x + m[1][0] * v.y + m[2][0] * v.z,
+                m[0][1] * v.x + m[1][1] * v.y + m[2][1] * v.z,
+                m[0][2] * v.x + m[1][2] * v.y + m[2][2] * v.z};
+    }
+
+    // Box holding the transformed box, the bounds of its transformed corners
+    inline AABB transformBounds(const AABB & box) const {
+        AABB bounds;
+        if (box.min.x > box.max.x)
+            return bounds;
+        for (int corner = 0; corner < 8; ++corner) {
+            bounds.grow(transformPoint({corner & 1 ? box.max.x : box.min.x, corner & 2 ? box.max.y : box.min.y,
+                    corner & 4 ? box.max.z : box.min.z}));
+        }
+        return bounds;
+    }
+} Transform;
+
+// Shadow ray counters of a render
+typedef struct ShadowStats
+{
+    unsigned long long rays;        // Shadow rays tested
+    unsigned long long occluded;    // Rays blocked before reaching their light
+    unsigned long long cacheTests;  // Rays first tested against the last occluder of their light
+    unsigned long long cacheHits;   // Rays blocked by that occluder, without traversing the BVH
+} ShadowStats;
 
 #endif
@@ -31,6 +31,30 @@ inline float determinant(
         (x_20 * ((x_01 * x_12) - (x_02 * x_11)));
 }
 
+// Inverse of an affine transform, false if its linear part is singular
+inline bool invertTransform(const Transform & transform, Transform & inverse)
+{
+    const float (*m)[4] = transform.m;
+    float det = determinant(m[0][0], m[0][1], m[0][2], m[1][0], m[1][1], m[1][2], m[2][0], m[2][1], m[2][2]);
+    if (det == 0.0f || !std::isfinite(det))
+        return false;
+
+    // Adjugate of the linear part over its determinant, then the translation taken back through it
+    float (*r)[4] = inverse.m;
+    r[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) / det;
+    r[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) / det;
+    r[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) / det;
+    r[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) / det;
+    r[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) / det;
+    r[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) / det;
+    r[2][0] = (m[1][0] * m[2][1] - m[1][1] * m[2][0]) / det;
+    r[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) / det;
+    r[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) / det;
+    for (int row = 0; row < 3; ++row)
+        r[row][3] = -(r[row][0] * m[0][3] + r[row][1] * m[1][3] + r[row][2] * m[2][3]);
+    return true;
+}
+
 inline float vectorLength(const Vector3f & vector) {
     return std::sqrt(vector.x * vector.x
                      + vector.y * vector.y
@@ -1,15 +1,271 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
 #include "Scene.h"
 #include "Camera.h"
+#include "RenderDaemon.h"
+#include "SceneFile.h"
 
-Scene *pScene; // definition of the global scene variable (declared in defs.h)
+static void printUsage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [--bvh=sah|binned] [--packet=N] [--render=recursive|wavefront] [--min-contribution=L] "
+            "[--light-cutoff=E] [--occluder-cache=on|off] [--scene-file] <scene.xml>\n", program);
+    fprintf(stderr, "       %s [options above] --batch <scene.xml>...\n", program);
+    fprintf(stderr, "       %s [options above] --daemon[=SOCKET] [--cache-size=N]\n", program);
+    fprintf(stderr, "  --bvh=sah     full quality SAH build, serial (default)\n");
+    fprintf(stderr, "  --bvh=binned  binned SAH build on all cores, for very large meshes\n");
+    fprintf(stderr, "  --packet=N    trace the primary rays of NxN pixel blocks together, N is 1 (off), 2, 4 (default) or 8\n");
+    fprintf(stderr, "  --render=recursive  follow the rays of each pixel depth first (default)\n");
+    fprintf(stderr, "  --render=wavefront  trace the rays of 16x16 tiles stage by stage, sorting reflected rays\n");
+    fprintf(stderr, "  --min-contribution=L  skip mirror reflections that change a pixel by less than L levels, 0 (exact) by default,\n");
+    fprintf(stderr, "                        any other value approximates the image\n");
+    fprintf(stderr, "  --light-cutoff=E  shade points only with the lights giving them an irradiance of at least E, 0 (all) by default\n");
+    fprintf(stderr, "  --occluder-cache=on|off  test the shape that last shadowed a light before traversing the BVH, on by default\n");
+    fprintf(stderr, "  --scene-file     load scenes from the binary scene files next to them, <scene.xml>.bin, with their BVH\n");
+    fprintf(stderr, "                   built by the same method, and write the file of a scene that has none or an outdated one\n");
+    fprintf(stderr, "  --batch          parse the scenes in parallel and render all of their cameras from one queue of tiles\n");
+    fprintf(stderr, "  --daemon         serve render requests read from stdin, one per line:\n");
+    fprintf(stderr, "                   scene.xml [--cameras=ID,ID,...] [--output=PATH], or quit\n");
+    fprintf(stderr, "  --daemon=SOCKET  serve the same requests on a Unix socket created at SOCKET\n");
+    fprintf(stderr, "  --cache-size=N   number of parsed scenes the daemon keeps, 4 by default\n");
+}
+
+static double millisecondsSince(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+/* Renders several scenes in one process: the scenes are loaded in parallel, then the tiles of every camera of every
+ * scene go through a single queue, so that no worker waits for another scene to start.
+ * Prints when each scene was done and the overall throughput. */
+static int renderBatch(const vector<const char *> & paths, const function<Scene *(const char *)> & load)
+{
+    for (const char *path : paths) {
+        FILE *file = fopen(path, "r");
+        if (!file) {
+            fprintf(stderr, "Cannot read %s\n", path);
+            return 1;
+        }
+        fclose(file);
+    }
+
+    auto start = chrono::steady_clock::now();
+    vector<Scene *> scenes(paths.size());
+    vector<double> setupTimes(paths.size());
+    atomic<int> nextScene(0);
+    vector<thread> parsers;
+    int numParsers = min<int>(paths.size(), max(thread::hardware_concurrency(), 1u));
+    for (int t = 0; t < numParsers; ++t) {
+        parsers.push_back(thread([&] {
+            for (int i = nextScene++; i < (int) paths.size(); i = nextScene++) {
+                auto sceneStart = chrono::steady_clock::now();
+                scenes[i] = load(paths[i]);
+                setupTimes[i] = millisecondsSince(sceneStart);
+            }
+        }));
+    }
+    for (thread & parser : parsers)
+        parser.join();
+    double setupTime = millisecondsSince(start);
+    if (find(scenes.begin(), scenes.end(), nullptr) != scenes.end()) {
+        for (Scene * scene : scenes)
+            delete scene;
+        return 1;
+    }
+    printf("Setup of %d scenes: %.3f ms\n", (int) scenes.size(), setupTime);
+
+    vector<RenderTarget> targets;
+    vector<int> sceneOf;
+    long long pixels = 0;
+    for (int i = 0; i < (int) scenes.size(); ++i) {
+        for (int x = 0; x < (int) scenes[i]->cameras.size(); ++x) {
+            targets.push_back({scenes[i], x});
+            sceneOf.push_back(i);
+            pixels += (long long) scenes[i]->cameras[x]->imgPlane.nx * scenes[i]->cameras[x]->imgPlane.ny;
+        }
+    }
+
+    // A scene is done when the last of its images is saved
+    vector<atomic<int>> remainingImages(scenes.size());
+    vector<double> doneTimes(scenes.size(), 0.0);
+    for (int i = 0; i < (int) scenes.size(); ++i)
+        remainingImages[i] = scenes[i]->cameras.size();
+    Renderer renderer;
+    auto renderStart = chrono::steady_clock::now();
+    renderer.render(targets, [&](int target, Image & image) {
+        int i = sceneOf[target];
+        image.saveImage(scenes[i]->cameras[targets[target].camera]->imageName);
+        if (--remainingImages[i] == 0)
+            doneTimes[i] = millisecondsSince(renderStart);
+    });
+    double renderTime = millisecondsSince(renderStart);
+
+    for (int i = 0; i < (int) scenes.size(); ++i) {
+        int numImages = scenes[i]->cameras.size();
+        printf("%s: %d image%s, setup %.3f ms, done %.3f ms into the render\n", paths[i], numImages,
+                numImages == 1 ? "" : "s", setupTimes[i], doneTimes[i]);
+        delete scenes[i];
+    }
+    printf("Render: %.3f ms, %lld pixels, %.3f Mpixels/s (%.3f Mpixels/s with setup)\n", renderTime,
+            pixels, pixels / (renderTime * 1000.0), pixels / ((setupTime + renderTime) * 1000.0));
+    return 0;
+}
 
 int main(int argc, char *argv[])
 {
-	const char *xmlPath = argv[1];
+	vector<const char *> xmlPaths;
+    bool batch = false;
+    BVH::BuildMethod bvhMethod = BVH::SweepSAH;
+    int packetSize = 4;
+    Scene::RenderMode renderMode = Scene::Recursive;
+    float minContribution = 0.0f;
+    float lightCutoff = 0.0f;
+    bool occluderCache = true;
+    bool sceneFile = false;
+    bool daemon = false;
+    const char *socketPath = nullptr;
+    int cacheSize = 4;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--bvh=sah") == 0)
+            bvhMethod = BVH::SweepSAH;
+        else if (strcmp(argv[i], "--bvh=binned") == 0)
+            bvhMethod = BVH::BinnedSAH;
+        else if (strcmp(argv[i], "--render=recursive") == 0)
+            renderMode = Scene::Recursive;
+        else if (strcmp(argv[i], "--render=wavefront") == 0)
+            renderMode = Scene::Wavefront;
+        else if (strcmp(argv[i], "--occluder-cache=on") == 0)
+            occluderCache = true;
+        else if (strcmp(argv[i], "--occluder-cache=off") == 0)
+            occluderCache = false;
+        else if (strcmp(argv[i], "--scene-file") == 0)
+            sceneFile = true;
+        else if (strcmp(argv[i], "--batch") == 0)
+            batch = true;
+        else if (strcmp(argv[i], "--daemon") == 0)
+            daemon = true;
+        else if (strncmp(argv[i], "--daemon=", 9) == 0 && argv[i][9] != '\0') {
+            daemon = true;
+            socketPath = argv[i] + 9;
+        }
+        else if (sscanf(argv[i], "--cache-size=%d", &cacheSize) == 1) {
+            if (cacheSize < 1) {
+                printUsage(argv[0]);
+                return 1;
+            }
+        }
+        else if (sscanf(argv[i], "--packet=%d", &packetSize) == 1) {
+            if (packetSize != 1 && packetSize != 2 && packetSize != 4 && packetSize != 8) {
+                printUsage(argv[0]);
+                return 1;
+            }
+        }
+        else if (sscanf(argv[i], "--min-contribution=%f", &minContribution) == 1) {
+            if (!(minContribution >= 0.0f)) {
+                printUsage(argv[0]);
+                return 1;
+            }
+        }
+        else if (sscanf(argv[i], "--light-cutoff=%f", &lightCutoff) == 1) {
+            if (!(lightCutoff >= 0.0f)) {
+                printUsage(argv[0]);
+                return 1;
+            }
+        }
+        else if (argv[i][0] == '-') {
+            printUsage(argv[0]);
+            return 1;
+        }
+        else
+            xmlPaths.push_back(argv[i]);
+    }
+    // One scene, several with --batch, none with --daemon
+    if (daemon ? batch || !xmlPaths.empty() : xmlPaths.empty() || (xmlPaths.size() > 1 && !batch)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    // Options every scene is rendered with
+    auto configure = [&](Scene & scene) {
+        scene.packetSize = packetSize;
+        scene.renderMode = renderMode;
+        scene.minContribution = minContribution;
+        scene.lightCutoff = lightCutoff;
+        scene.occluderCache = occluderCache;
+    };
+
+    // Scene of a file ready to render, read from its scene file when there is a usable one, nullptr if it is malformed
+    auto loadScene = [&](const char *xmlPath) {
+        Scene * scene = sceneFile ? SceneFile::load(xmlPath, bvhMethod) : nullptr;
+        if (!scene)
+            scene = Scene::parse(xmlPath);
+        if (!scene)
+            return scene;
+        configure(*scene);
+        // The scene file is written again whenever it lacked the scene or its BVH
+        if (!scene->bvh) {
+            scene->buildBVH(bvhMethod);
+            if (sceneFile)
+                SceneFile::save(*scene, xmlPath);
+        }
+        return scene;
+    };
+
+    if (daemon) {
+        RenderDaemon renderDaemon(cacheSize, loadScene);
+        if (socketPath)
+            return renderDaemon.serveSocket(socketPath);
+        renderDaemon.serve(stdin, stdout);
+        return 0;
+    }
+
+    if (batch)
+        return renderBatch(xmlPaths, loadScene);
+
+    // Same as loadScene, timing each step
+    auto start = chrono::steady_clock::now();
+    Scene * scene = sceneFile ? SceneFile::load(xmlPaths[0], bvhMethod) : nullptr;
+    if (scene)
+        printf("Load (%s): %.3f ms\n", SceneFile::getPath(xmlPaths[0]).c_str(), millisecondsSince(start));
+    else {
+        scene = Scene::parse(xmlPaths[0]);
+        if (!scene)
+            return 1;
+        printf("Parse: %.3f ms\n", millisecondsSince(start));
+    }
+    configure(*scene);
+
+    bool built = !scene->bvh;
+    if (built) {
+        start = chrono::steady_clock::now();
+        scene->buildBVH(bvhMethod);
+        printf("BVH build (%s): %.3f ms\n", bvhMethod == BVH::BinnedSAH ? "binned SAH" : "sweep SAH",
+                millisecondsSince(start));
+    }
+    if (sceneFile && built) {
+        start = chrono::steady_clock::now();
+        string path = SceneFile::getPath(xmlPaths[0]);
+        if (SceneFile::save(*scene, xmlPaths[0]))
+            printf("Save (%s): %.3f ms\n", path.c_str(), millisecondsSince(start));
+        else
+            fprintf(stderr, "Cannot write %s\n", path.c_str());
+    }
+    printf("BVH nodes: %.1f KB (%d wide, binary float layout would take %.1f KB)\n",
+            scene->bvh->getNodeMemory() / 1024.0, BVH_WIDTH, scene->bvh->getBinaryNodeMemory() / 1024.0);
 
-    pScene = new Scene(xmlPath);
+    start = chrono::steady_clock::now();
+    scene->renderScene();
+    printf("Render: %.3f ms\n", millisecondsSince(start));
 
-    pScene->renderScene();
+    const ShadowStats & shadows = scene->shadowStats;
+    printf("Shadow rays: %llu, %llu occluded\n", shadows.rays, shadows.occluded);
+    if (scene->occluderCache)
+        printf("Occluder cache: %llu tests, %llu hits (%.1f%% of tests, %.1f%% of occluded rays)\n",
+                shadows.cacheTests, shadows.cacheHits, 100.0 * shadows.cacheHits / max(shadows.cacheTests, 1ull),
+                100.0 * shadows.cacheHits / max(shadows.occluded, 1ull));
 
+    delete scene;
 	return 0;
 }
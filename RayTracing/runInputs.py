@@ -4,12 +4,11 @@ import os
 from subprocess import Popen
 import time
 
-ABS_PATH = "/home/yavuz/CLionProjects/ComputerGraphics/RayTracing/inputs"
-
-# TODO call time then push everythang
+SCRIPT_DIR = os.path.dirname(os.path.abspath(__file__))
 
 
 def runTests():
+    os.chdir(SCRIPT_DIR)
     print("Compiling...")
     p = Popen(['make', 'all'])
     retCode = p.wait()
@@ -19,17 +18,17 @@ def runTests():
     p = Popen(['mv', 'raytracer', 'outputs'])
     p.wait()
     os.chdir('outputs')
-    inputs = os.listdir(ABS_PATH)
-    for i in inputs:
-        print("Rendering {}...".format(i))
-        old = time.time()
-        p = Popen(['./raytracer', "../inputs/{}".format(i)]) # could've directly used time via PIPE
-        retCode = p.wait()
-        elapsed = time.time() - old
-        if retCode:
-            print("Oops, couldn't render {}, sth went wrong...".format(i))
-            exit(0)
-        print('{0} took {1:.3f} ms = {2:.3f} s = {3:.3f} mins.'.format(i, elapsed * 1000.0, elapsed, elapsed/60))
+    inputs = sorted(i for i in os.listdir(os.path.join(SCRIPT_DIR, 'inputs')) if i.endswith('.xml'))
+    # All scenes are rendered by one process, which reports when each of them was done
+    print("Rendering {}...".format(', '.join(inputs)))
+    old = time.time()
+    p = Popen(['./raytracer', '--batch'] + ["../inputs/{}".format(i) for i in inputs])
+    retCode = p.wait()
+    elapsed = time.time() - old
+    if retCode:
+        print("Oops, couldn't render the inputs, sth went wrong...")
+        exit(0)
+    print('All took {0:.3f} ms = {1:.3f} s = {2:.3f} mins.'.format(elapsed * 1000.0, elapsed, elapsed/60))
 
 
 if __name__ == "__main__":
@@ -0,0 +1,84 @@
+#!/usr/bin/env python3
+
+import os
+import shutil
+from subprocess import Popen, PIPE
+import tempfile
+
+SCRIPT_DIR = os.path.dirname(os.path.abspath(__file__))
+GOOD_SCENE = os.path.join(SCRIPT_DIR, 'inputs', 'simple_reflectance.xml')
+
+# Malformed versions of the good scene: each replaces one piece of its text
+MALFORMED = {
+    'garbage.xml': None,
+    'empty.xml': ('<Scene>', '<Scene></Scene><Unused>'),
+    'no_resolution.xml': ('<ImageResolution>', '<Unused>'),
+    'zero_resolution.xml': ('<ImageResolution>', '<ImageResolution>0 0</ImageResolution><Unused>'),
+    'long_image_name.xml': ('<ImageName>', '<ImageName>{}.ppm</ImageName><Unused>'.format('x' * 40)),
+    'missing_vertex.xml': ('<Center>', '<Center>100000</Center><Unused>'),
+    'missing_material.xml': ('<Material>', '<Material>100000</Material><Unused>'),
+    'no_lights.xml': ('<Lights>', '<Unused>'),
+    'negative_depth.xml': ('<MaxRecursionDepth>', '<MaxRecursionDepth>-3</MaxRecursionDepth><Unused>'),
+    'huge_depth.xml': ('<MaxRecursionDepth>', '<MaxRecursionDepth>2147483647</MaxRecursionDepth><Unused>'),
+    'missing_mesh.xml': ('<Objects>', '<Objects><Instance id="1"><Mesh>100000</Mesh>'
+                         '<Transform>1 0 0 0 0 1 0 0 0 0 1 0</Transform></Instance></Objects><Unused>'),
+}
+
+
+def writeMalformed(directory):
+    with open(GOOD_SCENE) as good:
+        text = good.read()
+    paths = []
+    for name, change in sorted(MALFORMED.items()):
+        if change is None:
+            malformed = 'not a scene <'
+        else:
+            # The element replaced is kept inside an unknown one, so the rest of the file stays well formed
+            old, new = change
+            closing = '</' + old[1:]
+            begin = text.index(old)
+            end = text.index(closing, begin) + len(closing)
+            malformed = text[:begin] + new + text[begin + len(old):end].replace(closing, '</Unused>') + text[end:]
+        path = os.path.join(directory, name)
+        with open(path, 'w') as f:
+            f.write(malformed)
+        paths.append(path)
+    return paths
+
+
+def runTests():
+    os.chdir(SCRIPT_DIR)
+    print("Compiling...")
+    p = Popen(['make', 'all'])
+    retCode = p.wait()
+    if retCode:
+        print("Oops, couldn't make all, sth went wrong...")
+        exit(1)
+
+    directory = tempfile.mkdtemp()
+    try:
+        # Every malformed scene has to be answered with an error, and the daemon has to render the good one after them
+        paths = writeMalformed(directory)
+        requests = paths + ['{} --output={}/'.format(GOOD_SCENE, directory), 'quit']
+        p = Popen(['./raytracer', '--daemon'], stdin=PIPE, stdout=PIPE, stderr=PIPE, universal_newlines=True)
+        out, _ = p.communicate('\n'.join(requests) + '\n')
+        replies = out.splitlines()
+        failed = p.returncode != 0 or len(replies) != len(paths) + 1
+        for path, reply in zip(paths, replies):
+            if reply != 'error cannot parse {}'.format(path):
+                print('{}: {}'.format(os.path.basename(path), reply))
+                failed = True
+        if len(replies) == len(paths) + 1 and not replies[-1].startswith('ok parsed'):
+            print('{}: {}'.format(os.path.basename(GOOD_SCENE), replies[-1]))
+            failed = True
+    finally:
+        shutil.rmtree(directory)
+        os.remove('raytracer')
+    if failed:
+        print("Oops, the daemon did not reject the malformed scenes and keep serving, exit code {}".format(p.returncode))
+        exit(1)
+    print("The daemon rejected {} malformed scenes and rendered the next one.".format(len(paths)))
+
+
+if __name__ == "__main__":
+    runTests()